@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <vector>
 #include <cstdint>
@@ -8,19 +9,66 @@
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
+#include <memory>
+#include <deque>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <glm/glm.hpp>
 
+#include "profiler.h"
+#include "tile_pool.h"
+
 static const int kCursorHeight = 30;
 static const int kCursorWidth = 30;
 
 class Game {
 public:
     Game() : Game(-1, -1, true) { }
-    Game(int screen_width, int screen_height, bool fullscreen = true);
+    Game(int screen_width, int screen_height, bool fullscreen = true,
+        bool headless = false);
+    ~Game() {
+        StopRenderThread();
+        StopChunkIo();
+    }
     void Start();
+    // SDL/X11を使わずにbuffer_へ描画し、Raycastingの処理速度を計測する
+    void Benchmark(int n_frames);
+    // Map midの全Chunkを指定した形式("raw" / "rle")のChunkファイルに書き直す
+    // 旧形式のMap(res/map/%08x.map)も変換する
+    void ConvertMap(int mid, const std::string &encoding);
+    // Chunkファイルをmmap(MAP_PRIVATE)して、BlockをファイルのPageから直接読む
+    // 変更はコピーオンライトでファイルには届かず、変更したChunkだけをSaveMap/解放時に
+    // 通常と同じく別名で書いてから置き換える(終了時に中途半端な変更が残らない)
+    void UseMmap(bool use_mmap);
+    // 描画に使うスレッド数(0ならハードウェアのスレッド数)
+    void SetNThreads(int n_threads);
+    // 描画の解像度の倍率を固定する(0なら目標のフレーム時間に合わせて毎フレーム選ぶ)
+    void LockRenderScale(float scale);
+    // 画面への転送と次のフレームの描画を別のスレッドで並行して行うか(既定はtrue)
+    void UsePipeline(bool use_pipeline);
+    // 画面への転送にOpenGLを使う(使えなければSDLのSurfaceに転送する)
+    // 画面の解像度のinternal_scale倍で描き、画面の大きさへの拡大はGPUで行う
+    void UseOpenGl(bool use_opengl, float internal_scale = 1.0);
+    // 区間ごとの時間とRayの数を、定期的にpathへ書き出す(.jsonなら統計、それ以外はCSV)
+    // (ファイルを開けなければfalse)
+    bool ExportProfile(const std::string &path);
+    // 視程(Block単位, kMinViewDist以上kMaxViewDist以下)。kLodDistより遠くは粗い格子で描く
+    // 遊んでいる間もPage Up / Page Downで変えられる
+    void SetViewDist(int view_dist);
+    static constexpr const int kMinViewDist = 16;
+    static constexpr const int kMaxViewDist = 320;
+
+    // 内部の処理を個別に計測するためのクラス(src/microbench.cc)
+    friend class MicroBench;
 
 private:
     // ======== Map ========
+    // 旧形式(res/map/%08x.map, 1ファイル)のMapの大きさ
     static constexpr const int kMapWidth = 64;
     static constexpr const int kMapDepth = 64;
     static constexpr const int kMapHeight = 64;
@@ -30,32 +78,371 @@ private:
     static constexpr const int kAirBlock = 0;
     static constexpr const int kTransparentBlock = kNBlocks - 1;
 
-    char world_map_[kMapHeight * kMapWidth * kMapDepth];
+    // Rayが衝突するBlockか(Air, Transparentは通り抜ける)
+    static bool IsSolidBlock(int block) {
+        return block != kAirBlock && block != kTransparentBlock;
+    }
+
+    // ======== Chunk ========
+    // Worldを16x16x16のChunkに分け、Playerの周りのChunkだけをメモリに載せる
+    static constexpr const int kChunkShift = 4;
+    static constexpr const int kChunkSize = 1 << kChunkShift;
+    static constexpr const int kChunkMask = kChunkSize - 1;
+    static constexpr const int kChunkVolume = kChunkSize * kChunkSize * kChunkSize;
+    // PlayerのいるChunkから横にchunk_load_dist_、上下にchunk_load_height_(Chunk単位)
+    // 以内のChunkを読み込み、それより1 Chunk以上離れたChunkを解放する
+    // chunk_load_dist_ * kChunkSizeは視程より大きくする(ToChunkLoadDist)
+    int chunk_load_dist_ = ToChunkLoadDist(kDefaultViewDist);
+    // 視程を伸ばしても上下はkMaxChunkLoadHeightまでしか読み込まないので、
+    // 読み込むChunkの数は視程の3乗ではなく2乗で増える(地形は主に横に広がる)
+    static constexpr const int kMaxChunkLoadHeight = 5;
+    int chunk_load_height_ = std::min(chunk_load_dist_, kMaxChunkLoadHeight);
+
+    // chunk_posがPlayerのいるChunkから、読み込む範囲よりmargin Chunk広い範囲にあるか
+    bool IsInChunkLoadRange(const glm::ivec3 &chunk_pos, int margin) const {
+        glm::ivec3 dist = glm::abs(chunk_pos - center_chunk_pos_);
+        return std::max(dist.x, dist.z) <= chunk_load_dist_ + margin &&
+            dist.y <= chunk_load_height_ + margin;
+    }
+
+    // Rayが空のBrick/Chunkを一度に飛ばせるように、
+    // 4x4x4 VoxelのBrickごとに衝突するBlockの有無を1bit/Voxelで持つ
+    static constexpr const int kBrickShift = 2;
+    static constexpr const int kBrickSize = 1 << kBrickShift;
+    static constexpr const int kBrickMask = kBrickSize - 1;
+    static constexpr const int kNChunkBricks = kChunkVolume
+        / (kBrickSize * kBrickSize * kBrickSize);
+
+    // 遠くを描くための粗い格子(LOD)
+    // 段l(1 <= l <= kNLodLevels)は一辺2^l Voxelのセルごとに、半分以上を占める
+    // 衝突するBlockのうち最も多いBlockを持つ(半分未満ならAir)
+    static constexpr const int kNLodLevels = 3;
+    // lod_blocksには段1, 2, 3のセルを順に並べる
+    static constexpr const int kLodVolume =
+        (kChunkVolume >> 3) + (kChunkVolume >> 6) + (kChunkVolume >> 9);
+    // 各段でも空の領域を一度に飛ばせるように、4x4x4セルごとに衝突するセルの有無を
+    // 1bit/セルで持つ(段1はChunkあたり8つ、段2, 3は1つ)
+    static constexpr const int kNLodBricks = 8 + 1 + 1;
+    static_assert(kNLodLevels == 3 && kChunkShift == 4 && kBrickShift == 2,
+        "LOD layout assumes 3 levels of 16^3 chunks with 4^3 bricks");
+
+    struct Chunk {
+        // Chunk内の座標(x, y, z)のBlockはblocks[(y * 16 + x) * 16 + z]
+        // 通常はown_blocksを指し、mmapしたChunkではファイルの写像の中を指す
+        char *blocks = own_blocks;
+        uint64_t brick_masks[kNChunkBricks];
+        // 遠くのRayが進む粗い格子(LOD)の代表のBlock(ToLodIndexで引く)
+        char lod_blocks[kLodVolume];
+        uint64_t lod_brick_masks[kNLodBricks];
+        int n_solid_blocks;
+        // 読み込んでから変更されたか(変更されたChunkだけを保存する)
+        bool dirty;
+        // Random tickを受けるBlockのChunk内の位置(Random tickではこれだけを調べる)
+        std::vector<uint16_t> random_tick_blocks;
+        // 各Voxelの明るさ(上位4bitが空の光、下位4bitがBlockの光、添字はblocksと同じ)
+        // 保存せず、読み込んだときに周りのChunkから求める
+        uint8_t light[kChunkVolume];
+        // mapping: mmapしたChunkファイル全体(mmapしていなければnullptr)
+        void *mapping = nullptr;
+        size_t mapping_size = 0;
+        char own_blocks[kChunkVolume];
+
+        Chunk() = default;
+        // 複製したChunkは常にown_blocksに持つ
+        Chunk(const Chunk &other);
+        Chunk &operator=(const Chunk &) = delete;
+        ~Chunk();
+    };
+
+    // 読み込んだChunkを引くための表(Chunk座標の各軸の下位kChunkTableShift bitで引く)
+    // 読み込むChunkは一辺2 * (chunk_load_dist_ + 1) + 1 Chunkの範囲に収まるので衝突しない
+    static constexpr const int kChunkTableShift = 6;
+    static constexpr const int kChunkTableMask = (1 << kChunkTableShift) - 1;
+    static constexpr const int kChunkTableSize = 1 << (3 * kChunkTableShift);
+
+    struct ChunkSlot {
+        long long key;
+        const Chunk *chunk;
+    };
+
+    int map_id_;
+    // 読み込んだChunk(全てAirのChunkはnullptrで持ち、empty_chunk_かdark_empty_chunk_を使う)
+    std::unordered_map<long long, std::unique_ptr<Chunk>> chunks_;
+    // 全てAirのChunkが共有するChunk(empty_chunk_は空の光が全て15、dark_empty_chunk_は全て0)
+    // 明るさが変わるときは複製し、その更新の後にどちらかと同じ明るさなら共有に戻す
+    Chunk empty_chunk_;
+    Chunk dark_empty_chunk_;
+    // Stack overflowを起こすので、Heap領域に確保する
+    std::vector<ChunkSlot> chunk_table_;
+    // 最後にChunkを読み込み・解放したときにPlayerがいたChunk
+    glm::ivec3 center_chunk_pos_;
+
+    static glm::ivec3 ToChunkPos(int x, int y, int z) {
+        return glm::ivec3(x >> kChunkShift, y >> kChunkShift, z >> kChunkShift);
+    }
+    static glm::ivec3 ToChunkPos(const glm::ivec3 &map_pos) {
+        return ToChunkPos(map_pos.x, map_pos.y, map_pos.z);
+    }
+    static long long ToChunkKey(const glm::ivec3 &chunk_pos) {
+        const long long mask = (1 << 21) - 1;
+        return (chunk_pos.y & mask) << 42 | (chunk_pos.x & mask) << 21
+            | (chunk_pos.z & mask);
+    }
+    static glm::ivec3 FromChunkKey(long long key) {
+        // 21bitずつの符号付き整数を取り出す
+        unsigned long long ukey = key;
+        return glm::ivec3((long long)(ukey << 22) >> 43,
+            (long long)(ukey << 1) >> 43, (long long)(ukey << 43) >> 43);
+    }
+    // Map上の座標に対応する、Chunk内のBlock, Brickの位置
+    static int ToChunkIndex(int x, int y, int z) {
+        return (((y & kChunkMask) << kChunkShift) + (x & kChunkMask)) << kChunkShift
+            | (z & kChunkMask);
+    }
+    static int ToBrickIndex(int x, int y, int z) {
+        const int shift = kChunkShift - kBrickShift;
+        const int mask = kChunkMask >> kBrickShift;
+        return (((y >> kBrickShift & mask) << shift) + (x >> kBrickShift & mask)) << shift
+            | (z >> kBrickShift & mask);
+    }
+    static uint64_t ToBrickBit(int x, int y, int z) {
+        return 1ull << ((((y & kBrickMask) << kBrickShift) + (x & kBrickMask))
+            << kBrickShift | (z & kBrickMask));
+    }
+    // 段levelの格子の座標(Map上の座標 >> level)に対応する、lod_blocksの位置
+    static int ToLodIndex(int level, int x, int y, int z) {
+        const int shift = kChunkShift - level;
+        const int mask = (1 << shift) - 1;
+        // 段levelより細かい段のセルの数の和
+        int offset = 0;
+        for (int l = 1; level > l; l++) {
+            offset += kChunkVolume >> 3 * l;
+        }
+        return offset + ((((y & mask) << shift) + (x & mask)) << shift | (z & mask));
+    }
+    // 段levelの格子の座標に対応する、lod_brick_masksの位置とbit
+    static int ToLodBrickIndex(int level, int x, int y, int z) {
+        if (level > 1) {
+            return 6 + level;
+        }
+        return ((y >> kBrickShift & 1) << 1 | (x >> kBrickShift & 1)) << 1
+            | (z >> kBrickShift & 1);
+    }
+    static uint64_t ToLodBrickBit(int level, int x, int y, int z) {
+        // 段3はChunkの一辺が2セルなので、Brickの一辺に満たない
+        const int mask = std::min(kBrickMask, (kChunkSize >> level) - 1);
+        return ToBrickBit(x & mask, y & mask, z & mask);
+    }
 
+    static int ToChunkTableIndex(const glm::ivec3 &chunk_pos) {
+        return (((chunk_pos.y & kChunkTableMask) << kChunkTableShift)
+            + (chunk_pos.x & kChunkTableMask)) << kChunkTableShift
+            | (chunk_pos.z & kChunkTableMask);
+    }
+    // 読み込まれていなければnullptr
+    const Chunk *FindChunk(const glm::ivec3 &chunk_pos) const {
+        const ChunkSlot &slot = chunk_table_[ToChunkTableIndex(chunk_pos)];
+        return slot.key == ToChunkKey(chunk_pos) ? slot.chunk : nullptr;
+    }
+    // 読み込まれていないChunkは、見えない壁(TransparentBlock)として扱う
     char GetMapBlock(int x, int y, int z) const {
-        assert(0 <= x && x < kMapWidth && 0 <= y && y < kMapHeight &&
-            0 <= z && z < kMapDepth);
-        return world_map_[y * kMapWidth * kMapDepth + x * kMapDepth + z];
+        const Chunk *chunk = FindChunk(ToChunkPos(x, y, z));
+        return chunk ? chunk->blocks[ToChunkIndex(x, y, z)] : kTransparentBlock;
     }
     char GetMapBlock(const glm::ivec3 &map_pos) const {
         return GetMapBlock(map_pos.x, map_pos.y, map_pos.z);
     }
-    void SetMapBlock(int x, int y, int z, char block) {
-        assert(0 <= x && x < kMapWidth && 0 <= y && y < kMapHeight &&
-            0 <= z && z < kMapDepth && 0 <= block && block < kNBlocks);
-        world_map_[y * kMapWidth * kMapDepth + x * kMapDepth + z] = block;
-    }
+    void SetMapBlock(int x, int y, int z, char block);
     void SetMapBlock(const glm::ivec3 &map_pos, char block) {
         SetMapBlock(map_pos.x, map_pos.y, map_pos.z, block);
     }
+    // 多くのBlockを一度に書き換える(描画のキャッシュは最後にまとめて捨てる)
+    void SetMapBlocks(const std::vector<glm::ivec3> &map_poses, char block);
+    // SetMapBlockのうち、Chunkを書き換える部分
+    // (全てAirのChunkにAirを書くときは何もせずfalseを返す)
+    bool WriteMapBlock(int x, int y, int z, char block);
+    void SetChunkBlock(Chunk &chunk, int index, char block);
+    void BuildBrickMap(Chunk &chunk);
+    void BuildLod(Chunk &chunk);
+    // Chunk内の座標(x, y, z)のBlockを含む、各段のセルを求め直す
+    static void UpdateLod(Chunk &chunk, int x, int y, int z);
+    // Chunk内の段levelの座標(x, y, z)のセルの代表のBlock
+    static char CalcLodBlock(const Chunk &chunk, int level, int x, int y, int z);
+
     std::string ToMapFileName(int mid) {
         std::stringstream ss;
         ss << "res/map/" << std::setfill('0') << std::setw(8)
             << std::hex << mid << ".map";
         return ss.str();
     }
+    // Chunkごとのファイル: res/map/%08x/<x>_<y>_<z>.chunk
+    std::string ToChunkDirName(int mid) {
+        std::stringstream ss;
+        ss << "res/map/" << std::setfill('0') << std::setw(8)
+            << std::hex << mid << "/";
+        return ss.str();
+    }
+    std::string ToChunkFileName(int mid, const glm::ivec3 &chunk_pos) {
+        std::stringstream ss;
+        ss << ToChunkDirName(mid) << chunk_pos.x << "_" << chunk_pos.y << "_"
+            << chunk_pos.z << ".chunk";
+        return ss.str();
+    }
     void LoadMap(int mid);
     void SaveMap(int mid);
+    // PlayerのいるChunkが変わったら、周りのChunkの読み込みを依頼し、
+    // 遠くのChunkを解放する(読み込みが終わったChunkは毎フレーム受け取る)
+    void UpdateChunks(bool force = false);
+    // 既に読み込んだChunkを置き換えるときは、元のChunkの変更は捨てる
+    void InsertChunk(const glm::ivec3 &chunk_pos, std::unique_ptr<Chunk> chunk);
+    // 全てAirのChunkが共有しているChunkか
+    bool IsSharedChunk(const Chunk *chunk) const {
+        return chunk == &empty_chunk_ || chunk == &dark_empty_chunk_;
+    }
+
+    // ======== Light ========
+    // 空の光とBlockの光(0 ~ 15)を、隣のVoxelへ1ずつ弱めながら幅優先で広げる
+    // 空の光の15は真下へは弱まらずに届く。光は衝突するBlockを通らない
+    // 空の光の光源は、上のChunkが読み込まれていないChunkの最上段のVoxel
+    // 読み込まれていないChunkとは光をやり取りしない(分からないものとして扱う)
+    static constexpr const int kMaxLight = 15;
+    // 光の種類ごとの、lightの中でのbitの位置
+    static constexpr const int kSkyLightShift = 4;
+    static constexpr const int kBlockLightShift = 0;
+    static const std::array<uint8_t, kNBlocks> kBlockLightEmission;
+    // 明るさごとの色の倍率(256で1倍)
+    static const std::array<uint16_t, kMaxLight + 1> kLightBrightness;
+
+    struct LightRemoval {
+        glm::ivec3 pos;
+        int level;
+    };
+    // 幅優先探索の待ち行列(先頭から順に取り出し、空になったら使い回す)
+    std::vector<glm::ivec3> light_queue_;
+    std::vector<LightRemoval> light_removal_queue_;
+    // 最後のUpdateLightで明るさが変わった範囲(描画のキャッシュを捨てる範囲)
+    glm::ivec3 light_changed_min_;
+    glm::ivec3 light_changed_max_;
+    // 光を書き込むために複製した、全てAirのChunkの位置(ShareEmptyChunksで調べる)
+    std::vector<glm::ivec3> light_copied_chunks_;
+
+    // 光を書き込めるChunk(読み込まれていなければnullptr、共有しているChunkは複製する)
+    Chunk *UnshareChunk(const glm::ivec3 &chunk_pos);
+    // 複製したChunkの明るさが共有するChunkと同じになっていれば、共有に戻す
+    void ShareEmptyChunks();
+    // 読み込まれていないChunkは暗いものとして描く
+    uint8_t GetMapLight(const glm::ivec3 &map_pos) const {
+        const Chunk *chunk = FindChunk(ToChunkPos(map_pos));
+        return chunk ? chunk->light[ToChunkIndex(map_pos.x, map_pos.y, map_pos.z)] : 0;
+    }
+    // 上のChunkが読み込まれていないか
+    bool IsSkyExposed(const glm::ivec3 &chunk_pos) const {
+        return !FindChunk(chunk_pos + glm::ivec3(0, 1, 0));
+    }
+    // Chunkのaxis方向の面(side: 0が負、1が正)に並ぶVoxelの最小の座標
+    // outsideなら面の外側で接するVoxel、そうでなければ内側のVoxel
+    static glm::ivec3 ToChunkFaceOrigin(const glm::ivec3 &chunk_pos, int axis, int side,
+        bool outside) {
+        glm::ivec3 map_pos = chunk_pos * kChunkSize;
+        if (outside) {
+            map_pos[axis] += side ? kChunkSize : -1;
+        }
+        else {
+            map_pos[axis] += side ? kChunkSize - 1 : 0;
+        }
+        return map_pos;
+    }
+    // 面のVoxelを待ち行列に入れる
+    void QueueChunkFace(const glm::ivec3 &chunk_pos, int axis, int side, bool outside);
+    // 空の光の光源になったChunkの最上段に、空の光の15を置く
+    void LightChunkTop(const glm::ivec3 &chunk_pos);
+    // 読み込んだChunkの明るさを求め、周りのChunkへ広げる
+    void BuildLight(const glm::ivec3 &chunk_pos);
+    // map_posのBlockがold_blockから変わったときに、周りの明るさを求め直す
+    void UpdateLight(const glm::ivec3 &map_pos, char old_block);
+    // light_removal_queue_の光を消し、消えた光の外側をlight_queue_に入れる
+    void RemoveLight(int shift);
+    // light_queue_のVoxelの光を広げる
+    void SpreadLight(int shift);
+    void SetLight(Chunk &chunk, const glm::ivec3 &map_pos, int shift, int level);
+
+    // ======== Chunk I/O ========
+    // Chunkファイル: Header + 符号化したBlockの列
+    // 旧形式のHeaderなし4096byteのファイルも読める
+    // version 1: rawのみ, version 2: RLEを追加
+    static constexpr const char kChunkFileMagic[4] = {'C', 'H', 'N', 'K'};
+    static constexpr const int kChunkFileVersion = 2;
+    enum ChunkEncoding : uint16_t {
+        kChunkEncodingRaw = 0,
+        // (Blockの数(uint16, little endian), Block)の3byteの列
+        // 保存したMapはほとんどAir/TransparentBlockの連続なので、よく縮む
+        kChunkEncodingRle = 1,
+    };
+    struct ChunkFileHeader {
+        char magic[4];
+        uint16_t version;
+        uint16_t encoding;
+        // data_size: 符号化したBlockの列の大きさ(byte)
+        uint32_t data_size;
+    };
+    // 保存に使う形式(RLEの方が大きくなる場合はrawで保存する)
+    ChunkEncoding chunk_encoding_ = kChunkEncodingRle;
+    // rawで保存されたChunkファイルをmmapするか(mmapする場合はrawで保存する)
+    bool use_mmap_ = false;
+
+    static void EncodeChunk(const Chunk &chunk, ChunkEncoding encoding,
+        std::vector<char> &data);
+    static bool DecodeChunk(ChunkEncoding encoding, const std::vector<char> &data,
+        Chunk &chunk);
+
+    // Chunkの読み書きは別スレッドで行い、Updateを止めない
+    // 保存は読み込みより先に行う(保存待ちのChunkを古いファイルから読まないため)
+    struct ChunkLoadRequest {
+        // priority: PlayerのいるChunkからの距離の2乗(小さいほど先に読む)
+        int priority;
+        glm::ivec3 chunk_pos;
+        bool operator<(const ChunkLoadRequest &other) const {
+            return priority > other.priority;
+        }
+    };
+    struct ChunkSaveRequest {
+        glm::ivec3 chunk_pos;
+        std::unique_ptr<Chunk> chunk;
+    };
+
+    std::thread chunk_io_thread_;
+    std::mutex chunk_io_mutex_;
+    // chunk_io_cv_: 依頼が来たとき, chunk_io_idle_cv_: 依頼を処理し終えたとき
+    std::condition_variable chunk_io_cv_;
+    std::condition_variable chunk_io_idle_cv_;
+    // 以下3つはchunk_io_mutex_で保護する
+    // load_requests_はstd::push_heap/pop_heapで優先度付きキューとして使う
+    std::vector<ChunkLoadRequest> load_requests_;
+    std::deque<ChunkSaveRequest> save_requests_;
+    std::vector<ChunkSaveRequest> loaded_chunks_;
+    bool chunk_io_busy_ = false;
+    bool chunk_io_quit_ = false;
+    // 読み込みを依頼して、まだ受け取っていないChunk(メインスレッドのみが触る)
+    std::unordered_set<long long> loading_chunks_;
+
+    void StartChunkIo();
+    void StopChunkIo();
+    // 依頼済みの読み書きが全て終わるまで待つ
+    void WaitChunkIo();
+    void ChunkIoLoop();
+    // PlayerのいるChunkが変わったときに、読み込み待ちの優先度を付け直す
+    void ReprioritizeChunkLoads();
+    void ReceiveLoadedChunks();
+    // Chunkを解放して周りの明るさを求め直す(変更されたChunkはsavesに入れる)
+    void UnloadChunks(const std::vector<glm::ivec3> &chunk_poses,
+        std::vector<ChunkSaveRequest> &saves);
+    // 以下はChunk I/Oスレッドから呼ぶ
+    std::unique_ptr<Chunk> ReadChunk(const glm::ivec3 &chunk_pos);
+    bool ReadChunkFile(const glm::ivec3 &chunk_pos, Chunk &chunk);
+    // rawのChunkファイルをmmapする(rawでなければfalse)
+    bool MapChunkFile(const glm::ivec3 &chunk_pos, Chunk &chunk);
+    bool ReadLegacyChunk(const glm::ivec3 &chunk_pos, Chunk &chunk);
+    void WriteChunkFile(const glm::ivec3 &chunk_pos, const Chunk &chunk);
 
     // ======== Textures ========
     static constexpr const int kNTexs = 21;
@@ -67,23 +454,73 @@ private:
     static const std::array<std::string, kNTexs> kTexFiles;
     static const std::array<long long int, kNBlocks> kBlockToTexs;
     static const std::array<std::string, kNBlocks> kBlockName;
-    std::vector<uint32_t> texs_[kNTexs];
+
+    // 全ての[Block][面]のテクスチャを、面の向きに合わせた反転と
+    // 面の明るさ(y面とz面は暗くする)を焼き込んだ状態で一つの配列に並べる
+    // (同じ画になる[Block][面]は同じTileを共有する)
+    // Mipmapの段(一辺16, 8, 4, 2, 1)ごとに別の配列にして、遠くのpixelが読む
+    // 小さな段がまとめてキャッシュに収まるようにする
+    static constexpr const int kNTexLevels = 5;
+    // 各Tileは64 byte(Cache line)の境界から始め、一辺4以下の段のTileは1本の
+    // Cache lineに収める(一辺2, 1の段は64 byteに満たないので残りは空ける)
+    static constexpr const int kTexelsPerLine = 16;
+    struct alignas(64) TexelLine {
+        uint32_t texels[kTexelsPerLine];
+    };
+    static int GetTexLinesPerTile(int level) {
+        int size = kTexWidth >> level;
+        return std::max(1, size * size / kTexelsPerLine);
+    }
+    // tex_atlas_[level]: 一辺(kTexWidth >> level)のTileをTileの順に並べたもの
+    std::vector<TexelLine> tex_atlas_[kNTexLevels];
+    // 段levelのTile tileの、Tile内のi番目(行ごとに並べた順)のtexel
+    uint32_t GetTexel(int level, int tile, int i) const {
+        return tex_atlas_[level][tile * GetTexLinesPerTile(level) + i / kTexelsPerLine]
+            .texels[i % kTexelsPerLine];
+    }
+    void SetTexel(int level, int tile, int i, uint32_t color) {
+        tex_atlas_[level][tile * GetTexLinesPerTile(level) + i / kTexelsPerLine]
+            .texels[i % kTexelsPerLine] = color;
+    }
+    // [Block][面] -> Tileの番号
+    std::array<std::array<uint16_t, 6>, kNBlocks> face_tiles_;
+    // 距離1の面で1 pixelが覆うテクスチャのtexel数(Mipmapの段を選ぶのに使う)
+    float pixel_footprint_;
 
     // face: ブロックの面
     // 0: x+面, 1: x-面, 2: y+面, 3: y-面, 4: z+面, 5: z-面
-    int GetTex(int block, int face) const {
-        assert(0 <= block && block < kNBlocks && 0 <= face && face < 6);
-        return kBlockToTexs[block] >> (face * 8) & 0xff;
-    }
-    uint32_t GetTexColor(int tex, int x, int y) const {
-        assert(0 <= tex && tex < kNTexs && 0 <= x && x < kTexWidth &&
-            0 <= y && y < kTexHeight);
-        return texs_[tex][kTexWidth * y + x];
+    // (x, y): 面上の位置(Mapの座標の小数部分 * テクスチャの大きさ)
+    uint32_t GetFaceTexColor(int block, int face, int level, int x, int y) const {
+        assert(0 <= block && block < kNBlocks && 0 <= face && face < 6 &&
+            0 <= level && level < kNTexLevels &&
+            0 <= x && x < kTexWidth && 0 <= y && y < kTexHeight);
+        int size = kTexWidth >> level;
+        int tile = face_tiles_[block][face];
+        return GetTexel(level, tile, (y >> level) * size + (x >> level));
     }
     void LoadTexs();
 
     // ======== Ray ========
-    static constexpr const int kMaxRayDist = 60;
+    // 視程(Block単位)。Rayはこれより遠くへは進まず、霧はここで真っ白になる
+    static constexpr const int kDefaultViewDist = 60;
+    // Page Up / Page Downで視程を変える幅
+    static constexpr const int kViewDistStep = 16;
+    int view_dist_ = kDefaultViewDist;
+    // kLodDistまでは1Voxelずつ進み、それより遠くは距離が2倍になるごとに
+    // 1段粗い格子で進む(段lはkLodDist * 2^(l - 1)から)
+    // 1段進むごとにセルの一辺も2倍になるので、進むセルの数は距離に対して対数的にしか増えない
+    static constexpr const int kLodDist = 64;
+
+    static int ToChunkLoadDist(int view_dist) {
+        return (view_dist + kChunkMask) / kChunkSize + 1;
+    }
+    static_assert(2 * ((kMaxViewDist + kChunkMask) / kChunkSize + 2) + 1
+        <= 1 << kChunkTableShift, "Chunk table is too small");
+    // 段levelで進む最も遠い距離
+    float GetLodEndDist(int level) const {
+        return level == kNLodLevels ? view_dist_
+            : std::min<float>(view_dist_, kLodDist << level);
+    }
 
     struct Ray {
         glm::vec3 dir;
@@ -91,8 +528,21 @@ private:
         // collision_side: 衝突した面に垂直な軸
         // 0: x軸(面はy-z平面), 1: y軸, 2: z軸
         int collision_side;
+        // block: 衝突したBlock
+        char block;
         float perp_wall_dist;
         float max_perp_wall_dist;
+        // n_steps: DDAで進んだVoxelの数
+        int n_steps;
+    };
+    // DDAの途中の状態(CastRayPacketから1本ずつの処理に切り替えるときに引き継ぐ)
+    struct RayDda {
+        glm::vec3 delta_dist;
+        glm::ivec3 step;
+        glm::ivec3 pos;
+        glm::vec3 side_dist;
+        int side;
+        int n_steps;
     };
 
     // ======== Player ========
@@ -104,16 +554,176 @@ private:
     static constexpr const float kPlayerPutBlockDist = 5.0;
     static constexpr const float kPlayerDestBlockDist = 5.0;
 
+    // pos_: カメラ(Playerの目)の位置。物理で動かした位置を描画の時刻に合わせて補間したもの
     glm::vec3 pos_, dir_, plane_x_, plane_y_;
     int select_block_ = 1;
 
+    // ======== Physics ========
+    // Playerの移動は描画のフレームレートによらず、kPhysicsTimeStep秒ずつ進める
+    static constexpr const float kPhysicsTimeStep = 1.0 / 60;
+    // 1回に進める最大のstep数(長く止まった後に、まとめて進めすぎないように)
+    static constexpr const int kMaxPhysicsSteps = 8;
+    static constexpr const float kWalkSpeed = 5.0;
+    static constexpr const float kGravity = 32.0;
+    // 約1.2 Blockの高さまで跳ぶ
+    static constexpr const float kJumpSpeed = 9.0;
+    static constexpr const float kMaxFallSpeed = 60.0;
+    // 面で接しているBlockを、重なっているBlockと見なさないための余裕
+    static constexpr const float kCollisionEps = 1e-3;
+
+    // player_pos_: 最後のstepの後の位置, prev_player_pos_: その1 step前の位置
+    glm::vec3 player_pos_;
+    glm::vec3 prev_player_pos_;
+    glm::vec3 velocity_;
+    bool on_ground_ = false;
+    // 飛んでいる間は重力がかからず、Space / 左Shiftで上下に動く(Fで切り替える)
+    bool flying_ = false;
+    // HandleKeysが読んだ入力(移動の向き(長さ1以下)と、Spaceを押しているか)
+    glm::vec3 move_input_;
+    bool jump_input_ = false;
+    // まだ進めていない時間(秒)と、最後に進めた時刻(ms)
+    float physics_time_ = 0.0;
+    unsigned long physics_ticks_ = 0;
+
+    void StepPhysics(float dt);
+    // 目の位置がposのときのPlayerの箱
+    static void GetPlayerBox(const glm::vec3 &pos, glm::vec3 &box_min, glm::vec3 &box_max);
+    // 箱を軸axisにmoveだけ動かす間に、先頭の面が通る全てのBlockを近い順に調べ、
+    // Air以外のBlock(読み込まれていないChunkも含む)に当たればmoveを
+    // そのBlockの手前までに縮めてtrueを返す(速く動いても突き抜けない)
+    bool SweepBox(const glm::vec3 &box_min, const glm::vec3 &box_max, int axis,
+        float &move) const;
+    // player_pos_をmoveだけ動かす(y, x, zの順に動かし、当たった軸の速度は0にする)
+    void MovePlayer(const glm::vec3 &move);
+
+    // ======== Tick ========
+    // Blockの時間変化(TNTの導火線、葉の消滅など)は、物理のkStepsPerTick stepごとの
+    // tick(1秒に20回)で進める
+    static constexpr const int kStepsPerTick = 3;
+    static constexpr const int kCherryLogBlock = 5;
+    static constexpr const int kCherryLeavesBlock = 7;
+    static constexpr const int kTntBlock = 12;
+    // 火を付けてから爆発するまでのtick数
+    static constexpr const int kTntFuseTicks = 80;
+    // Random tickを受けるBlockを含むChunkで、1 tickに選ぶ位置の数
+    // (各Blockは1 tickにkRandomTicksPerChunk / kChunkVolumeの確率で選ばれる)
+    static constexpr const int kRandomTicksPerChunk = 3;
+    // この距離(各軸)以内にCherry logがない葉は消える
+    static constexpr const int kLeafDecayDist = 4;
+
+    struct ScheduledTick {
+        long long tick;
+        // 同じtickの予定は予約した順に処理する
+        long long order;
+        glm::ivec3 pos;
+        // 予約したときのBlock(置き換わっていたら処理しない)
+        char block;
+        bool operator<(const ScheduledTick &other) const {
+            return tick != other.tick ? tick > other.tick : order > other.order;
+        }
+    };
+
+    long long tick_ = 0;
+    int tick_steps_ = 0;
+    long long n_scheduled_ticks_ = 0;
+    // 予約されたtick(std::push_heapで時刻の早い順に並べる)と、予約されている位置
+    std::vector<ScheduledTick> scheduled_ticks_;
+    std::unordered_set<long long> scheduled_tick_keys_;
+    // Random tickを受けるBlockを含む、読み込まれたChunk
+    std::unordered_set<long long> random_tick_chunks_;
+    // TickBlocksで調べるChunk(処理中にrandom_tick_chunks_が変わってもよいように写す)
+    std::vector<long long> tick_chunks_;
+    std::mt19937 tick_rng_;
+
+    static bool HasRandomTick(int block) {
+        return block == kCherryLeavesBlock;
+    }
+    // Blockの位置を引くためのKey(Chunk座標と同じく21bitずつ詰める)
+    static long long ToBlockKey(const glm::ivec3 &map_pos) {
+        return ToChunkKey(map_pos);
+    }
+    static glm::ivec3 FromBlockKey(long long key) {
+        return FromChunkKey(key);
+    }
+    // 前回から経った時間だけkPhysicsTimeStepずつ物理とtickを進め、pos_を補間する
+    void UpdateSimulation();
+    // 1 tick進め、処理したBlockの数を返す
+    int TickBlocks();
+    // map_posのBlockをdelay tick後に処理する(既に予約されていれば何もしない)
+    void ScheduleBlockTick(const glm::ivec3 &map_pos, int delay);
+    void OnScheduledTick(const glm::ivec3 &map_pos, char block);
+    void OnRandomTick(const glm::ivec3 &map_pos, char block);
+    void IgniteTnt(const glm::ivec3 &map_pos);
+    // 近くにCherry logがある(または近くのChunkが読み込まれておらず分からない)か
+    bool IsLeafSupported(const glm::ivec3 &map_pos) const;
+    void ClearTicks();
+
+    // ======== Explosion ========
+    // 爆発の中心から全方向に短いRayを飛ばし、Rayが届いたBlockを壊す
+    // Rayの強さは進むたびに減り、Blockを通るとそのBlockの爆発耐性の分だけさらに減る
+    static constexpr const float kTntPower = 4.0;
+    // Rayは一辺kBlastGrid個の格子の表面の点の向きに飛ばす(16なら1352本)
+    static constexpr const int kBlastGrid = 16;
+    static constexpr const int kNBlastRays = kBlastGrid * kBlastGrid * kBlastGrid
+        - (kBlastGrid - 2) * (kBlastGrid - 2) * (kBlastGrid - 2);
+    static constexpr const float kBlastStep = 0.3;
+    // 1回に並列で処理するRayの数(爆発ごとにkNBlastRays / kBlastRaysPerTask個に分ける)
+    static constexpr const int kBlastRaysPerTask = 169;
+    static_assert(kNBlastRays % kBlastRaysPerTask == 0,
+        "blast rays must split evenly into tasks");
+    // 1 tickに爆発させるTNTの数(残りは次のtickに回し、大量のTNTでもフレームが止まらない)
+    static constexpr const int kMaxExplosionsPerTick = 16;
+    // 爆発に巻き込まれたTNTは、この範囲のtick数の後に爆発する
+    static constexpr const int kChainFuseMinTicks = 10;
+    static constexpr const int kChainFuseMaxTicks = 30;
+    static const std::array<float, kNBlocks> kBlockBlastResistance;
+
+    struct Explosion {
+        glm::ivec3 pos;
+        // Rayごとの強さのばらつきを決める乱数の種
+        uint32_t seed;
+    };
+
+    // 導火線が燃え尽き、爆発を待っているTNT
+    std::deque<Explosion> pending_explosions_;
+    // このtickに処理する爆発
+    std::vector<Explosion> explosions_;
+    // kBlastStepの長さのRayの向き
+    std::vector<glm::vec3> blast_steps_;
+    // スレッドごとに、Rayが届いたBlockのKey(ToBlockKey)
+    std::vector<std::vector<long long>> blast_hits_;
+    // 全ての爆発で壊れるBlockのKey(重複なし)と、Airにする位置
+    std::vector<long long> blast_blocks_;
+    std::vector<glm::ivec3> blast_removals_;
+
+    void BuildBlastSteps();
+    // 溜まっている爆発をkMaxExplosionsPerTick個まで処理し、処理した数を返す
+    int ProcessExplosions();
+    // explosionsのRayを並列に飛ばし、壊れるBlockをblast_blocks_に求める
+    void TraceExplosions(const std::vector<Explosion> &explosions);
+    void TraceBlastRay(const Explosion &explosion, int ray, std::vector<long long> &hits) const;
+
     // ======== Screen ========
     int screen_width_;
     int screen_height_;
     bool fullscreen_;
+    // headless_: SDLの画面を作らず、buffer_にだけ描画する
+    bool headless_;
+    // OpenGLで転送するときは、screen_width_ x screen_height_で描いた画を
+    // window_width_ x window_height_のWindowに拡大して表示する(Mouseの座標はWindowの座標)
+    bool use_opengl_ = false;
+    float opengl_internal_scale_ = 1.0;
+    int window_width_;
+    int window_height_;
 
     // Stack overflowを起こすので、Heap領域にメモリを確保
+    // 画面のSurfaceに直接書けるときは、そのpixelを指す(drawBufferのコピーが要らない)
+    // buffer_: Raycastingが描く画, front_buffer_: 画面に転送する画
+    // Pipelineを使わなければ同じものを指す
     uint32_t *buffer_;
+    uint32_t *front_buffer_;
+    std::unique_ptr<uint32_t[]> own_buffer_;
+    std::unique_ptr<uint32_t[]> own_front_buffer_;
 
     uint32_t GetBufColor(int x, int y) const {
         assert(0 <= x && x < screen_width_ && 0 <= y && y < screen_height_);
@@ -128,33 +738,253 @@ private:
     float time_;
     float old_time_;
     float frame_time_;
+    // 描画スレッドが倍率を選ぶのに使うフレーム時間
+    // (描画中にメインスレッドがframe_time_を更新するので、描き始める前に写しておく)
+    float render_frame_time_;
+
+    // ======== Redraw ========
+    // 画面が変わるような変化(カメラの移動や回転、Blockの変更、Chunkの読み込み)が
+    // あったときにtrueにする
+    // falseの間はRaycastingも画面への転送も行わず、入力を待つ
+    bool redraw_ = true;
+    // 描かないフレームで入力を待つ最長の時間(秒)
+    // (その間に読み込まれたChunkを表示するために、時々起きる)
+    static constexpr const float kIdleTimeout = 0.1;
+    // 入力のイベントが来るか、timeout秒経つまで待つ
+    void WaitInput(float timeout);
+
+    // ======== HUD ========
+    // fps、選択中のBlock、描画の倍率を表示する範囲
+    static constexpr const int kHudX = 20;
+    static constexpr const int kHudY = 20;
+    static constexpr const int kHudWidth = 256;
+    static constexpr const int kHudHeight = 48;
+    // HUDだけが変わったとき(選択中のBlockの変更)にtrueにする
+    // 画は描き直さず、HUDの範囲だけ描き直して転送する
+    bool redraw_hud_ = false;
+    // HUDを描く前の画(buffer_が画面そのものだと、HUDの文字で上書きされるので)
+    std::vector<uint32_t> hud_background_;
+    // HUDに表示する、画面に出ている画を描いたときの倍率
+    float hud_render_scale_ = 0.0;
+    void SaveHudBackground();
+    void RestoreHudBackground();
+    void DrawHud();
+    // HUDの範囲だけを描き直して転送する
+    void RedrawHud();
+
+    // ======== Pipeline ========
+    // フレームNを画面に転送している間に、描画スレッドでフレームN+1をもう一方の
+    // bufferに描く(SDLの呼び出しはメインスレッドに残す)
+    // 描画中はMapやカメラを変えられないので、入力は描画を依頼する直前に読む
+    bool use_pipeline_ = true;
+    std::thread render_thread_;
+    std::mutex render_mutex_;
+    // render_cv_: 描画を依頼したとき, render_done_cv_: 描画が終わったとき
+    std::condition_variable render_cv_;
+    std::condition_variable render_done_cv_;
+    // 以下2つはrender_mutex_で保護する
+    bool render_requested_ = false;
+    bool render_quit_ = false;
+    // 描画を依頼して、まだ転送していないフレームがあるか(メインスレッドのみが触る)
+    bool render_pending_ = false;
+
+    void StartRenderThread();
+    void StopRenderThread();
+    void RenderThreadLoop();
+    // buffer_へ次のフレームを描くように依頼する
+    void RequestRender();
+    // 依頼した描画が終わるまで待つ(描いたフレームがあればtrue)
+    bool WaitRender();
+
+    // ======== Render ========
+    // Tileの一辺(pixel)。PacketRaycastingの2x2が割り切れるように偶数にする
+    static constexpr const int kTileSize = 32;
+    // EdgeAwareRaycastingの格子の間隔と、それが割り切れるTileの一辺
+    static constexpr const int kEdgeAwareStride = 3;
+    static constexpr const int kEdgeAwareTileSize = 33;
+
+    // 描画の解像度の倍率(高画質順)
+    // 1 / n: n x n pixelごとに1本のRayを飛ばして同じ色で埋める
+    // それ以外: 縮小した解像度で描き、双線形補間で拡大する
+    static constexpr const int kNRenderScales = 5;
+    static constexpr const float kRenderScales[kNRenderScales] = {
+        1.0, 0.75, 0.6, 1.0 / 2, 1.0 / 3,
+    };
+    // 目標のフレーム時間(秒)
+    static constexpr const float kTargetFrameTime = 1.0 / 60;
+    // 解像度を変えてから、次に変えるまでに待つフレーム数
+    static constexpr const int kRenderScaleCooldown = 10;
+
+    // 最初は最も軽い倍率から始めて、余裕があれば上げていく
+    int render_scale_level_ = kNRenderScales - 1;
+    // 0でなければこの倍率に固定する
+    float locked_render_scale_ = 0.0;
+    int render_scale_cooldown_ = 0;
+    // 1フレームの揺れで倍率が変わらないように、フレーム時間を平滑化する
+    float smoothed_frame_time_ = 0.0;
+    // 縮小した解像度で描いた画(行はRayのyの順に並べる)
+    std::vector<uint32_t> scaled_buffer_;
+    int scaled_width_ = 0;
+    int scaled_height_ = 0;
+
+    int n_threads_ = 0;
+    std::unique_ptr<TilePool> tile_pool_;
+    // スレッドごとに数えて、描画後に足し合わせる
+    struct alignas(64) RayCounter {
+        long long n_rays;
+        long long n_ray_steps;
+        long long n_hits;
+    };
+    std::vector<RayCounter> ray_counters_;
+    // 直前のRenderTilesの統計(拡大の処理は含まない)
+    TilePool::Stats render_stats_ = {};
+
+    // ======== G-buffer ========
+    // PacketRaycastingで、Rayを進めた結果を色を付ける処理に渡す
+    // 何にも当たらなかったpixelは、色を0xFFFFFF、距離を0にする(霧をかけても白のまま)
+    // 添字はbuffer_と同じ(行は上下反転済み)
+    std::vector<uint32_t> gbuffer_colors_;
+    std::vector<float> gbuffer_dists_;
+    std::vector<float> gbuffer_max_dists_;
+
+    // ======== Render cache ========
+    // 前のフレームの各pixelが当たったBlockと面
+    // カメラが回転しただけなら、新しいRayが同じ面に当たるか調べてRayを飛ばさずに描く
+    struct CachedPixel {
+        glm::ivec3 pos;
+        uint32_t color;
+        // side: collision_side。何にも当たらなければkCacheMiss、使えなければkCacheInvalid
+        int8_t side;
+        char block;
+    };
+    static constexpr const int8_t kCacheMiss = -1;
+    static constexpr const int8_t kCacheInvalid = -2;
+    // 行はRayのyの順に並べる
+    std::vector<CachedPixel> render_cache_;
+    // ReprojectRaycastingはrender_cache_を読みながらこちらに書き、最後に入れ替える
+    std::vector<CachedPixel> next_render_cache_;
+    bool render_cache_valid_ = false;
+    // render_cache_を描いたときのカメラ
+    glm::vec3 cache_pos_;
+    glm::vec3 cache_dir_;
+    glm::vec3 cache_plane_x_;
+    glm::vec3 cache_plane_y_;
+    // 前のフレームを描いたときのカメラ(止まっているか、見回しているだけかの判定に使う)
+    glm::vec3 last_render_pos_;
+    glm::vec3 last_render_dir_;
+    glm::vec3 last_render_plane_x_;
+    glm::vec3 last_render_plane_y_;
+    bool reprojected_last_frame_ = false;
+    // 前に再利用したフレームで飛ばし直したRayが、縮小して描くときのRayより多かったか
+    bool reproject_costly_ = false;
+
+    // 画面を一辺tile_sizeのTileに分けて描画し、n_rays_, n_ray_steps_を更新する
+    // render(x0, y0, x1, y1, counter): [x0, x1) x [y0, y1)の範囲を描画する
+    void RenderTiles(int width, int height, int tile_size,
+        const std::function<void(int, int, int, int, RayCounter &)> &render);
+
+    // ======== Stats ========
+    // 直前のRaycastingで飛ばしたRayの数と、DDAで進んだVoxelの総数、衝突したRayの数
+    long long n_rays_;
+    long long n_ray_steps_;
+    long long n_hits_;
+
+    // ======== Profiler ========
+    // 入力、描画、転送などの区間の時間を毎フレーム記録する
+    Profiler profiler_;
+    // 統計をHUDの下に表示するか(F3で切り替える)
+    bool show_profile_ = false;
+    void DrawProfile();
 
     // ======== Input ========
     // QuickCGではMouseのPressが取れないので、flagを持っておく
     bool prev_lmb_;
     bool prev_rmb_;
 
-    void Init();
+    // Map midを読み込んで始める
+    void Init(int mid = 0);
     void InitScreen();
     void InitPlayer();
 
     void Update();
+    // 描画とHandleInputを重ねて行うUpdate
+    void UpdatePipelined();
+    // buffer_に1フレームを描く
+    void RenderFrame();
+    // front_buffer_とHUDを画面に転送し、フレーム時間を測る
+    void PresentFrame();
     void DrawCursor();
-    bool CastRay(int x, int y, Ray &ray) const;
+    // 縮小して描くときは、pixelの間の位置(x, y)にもRayを飛ばす
+    bool CastRay(float x, float y, Ray &ray) const;
+    // pixel(x, y)のRayの向きとDDAの初期状態を求める
+    void InitRay(float x, float y, Ray &ray, RayDda &dda) const;
+    glm::vec3 CalcRayDir(float x, float y) const;
+    // pixel(x, y)のRayが、hitと同じBlockの同じ面に当たるとしてrayを求める(DDAは行わない)
+    void HitSameFace(float x, float y, const Ray &hit, Ray &ray) const;
+    // ddaの状態からRayを進める
+    bool TraceRay(Ray &ray, RayDda dda) const;
+    // pixel(x, y)からの2x2 pixelの4本のRayをSIMDでまとめて進める
+    // rays[i]はpixel(x + i % 2, y + i / 2)、戻り値のbit iはrays[i]が衝突したか
+    int CastRayPacket(int x, int y, Ray rays[4]) const;
+    // ddaの状態(TraceRayがkLodDistで止まった位置)から、粗い格子でRayを進める
+    bool TraceLodRay(Ray &ray, RayDda dda) const;
+    // 空のCell(一辺cell_size)を抜けた最初のVoxelまでposを進め、越えた面の軸を返す
+    // max_distを越える場合は-1
+    static int SkipEmptyCell(int cell_size, const glm::ivec3 &step,
+        const glm::vec3 &dir, const glm::vec3 &delta_dist, glm::vec3 &side_dist,
+        glm::ivec3 &pos, float max_dist);
     uint32_t CalcPixelColor(const Ray &ray) const;
+    // 霧をかける前の、テクスチャの色(面の明るさを掛けたもの)
+    uint32_t CalcTexColor(const Ray &ray) const;
+    // 面の手前(Rayが来た側)のVoxelの明るさ
+    int CalcFaceLight(const Ray &ray) const;
+    static uint32_t ApplyLight(uint32_t color, int light);
+    static uint32_t ApplyFog(uint32_t color, float dist, float max_dist);
     void SimpleRaycasting();
     void SlackOffRaycasting();
+    // stride x stride pixelごとに1本のRayを飛ばし、同じ色で埋める
+    void StrideRaycasting(int stride);
+    // 解像度をscale倍にして描き、双線形補間で画面の大きさに拡大する
+    void UpscaleRaycasting(float scale);
+    // scale倍の解像度で描く(倍率に合わせて上の方法を選ぶ)
+    void ScaledRaycasting(float scale);
+    // フレーム時間から倍率を選んで描く
+    void AdaptiveRaycasting();
+    void UpdateRenderScale();
+    float GetRenderScale() const {
+        return locked_render_scale_ > 0.0
+            ? locked_render_scale_ : kRenderScales[render_scale_level_];
+    }
+    // SimpleRaycastingと同じ画をCastRayPacketで描く
+    // Tileごとに、Rayを進めてG-bufferに書く処理と、G-bufferから色を付ける処理を分けて行う
+    void PacketRaycasting();
+    void TraceGBufferTile(int x0, int y0, int x1, int y1, RayCounter &counter);
+    void ShadeGBufferTile(int x0, int y0, int x1, int y1);
+    // 粗い格子にRayを飛ばし、四隅が同じBlockの同じ面に当たったマスは
+    // 残りのpixelを面との交点から求め、そうでないマスだけ全てのpixelにRayを飛ばす
+    // fill_cache: 描いた結果をrender_cache_に残す
+    void EdgeAwareRaycasting(bool fill_cache = false);
+    // カメラの位置が変わっていなければ、render_cache_を再利用して描く
+    // (使えないpixelだけRayを飛ばす)
+    void ReprojectRaycasting();
+    // カメラからの方向vが、render_cache_を描いたときの画面のどこに映るか
+    bool ToCacheScreen(const glm::vec3 &v, float &x, float &y) const;
+    // render_cache_の(x, y)を囲む4 pixelが同じ面に当たっていればその1つを返す
+    const CachedPixel *FindCachedFace(float x, float y) const;
+    // Blockが変わったときに、そのBlockが映り得るpixelのrender_cache_を捨てる
+    // (粗い格子で描いているときは、Blockを含む最も大きいセルが映り得るpixel)
+    void InvalidateRenderCache(const glm::ivec3 &block_pos) {
+        InvalidateRenderCache(block_pos, block_pos);
+    }
+    // box_min ~ box_maxのBlockに当たる、または通り抜けるpixelを捨てる
+    void InvalidateRenderCache(const glm::ivec3 &box_min, const glm::ivec3 &box_max);
+
+    // frame番目のカメラの位置と向きを設定する(Benchmark用の決まった経路)
+    void SetBenchCamera(int frame, int n_frames);
+    void BenchRaycasting(const std::string &name,
+        const std::function<void()> &raycasting, int n_frames);
 
-    // part: Playerの部位を指定
-    // x: 0: x-(Playerのx-面のx座標), 1: x+
-    // y: 0: y-, 1: y(Playerの中心のy座標), 2: y+
-    // z: 0: z-, 1: z+
-    glm::ivec3 GetPlayerPartPos(const glm::ivec3 &part) const;
-    bool HitBlock(const std::vector<glm::ivec3> &parts) const;
     void TryRotateY(float angle);
-    void TryMoveX(float mvx);
-    void TryMoveY(float mvy);
-    void TryMoveZ(float mvz);
 
     void HandleKeys();
     void HandleMouseMove(int mouse_x, int mouse_y);
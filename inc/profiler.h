@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// フレームごとに区間ごとの時間とRayなどの数を集計し、
+// 直近kNFramesフレームの平均と百分位数を求める
+// 時間と数はatomicに足すので、描画スレッドからも記録できる
+class Profiler {
+public:
+    enum Section {
+        // 前のフレームを転送し終えてから、このフレームを転送し終えるまで
+        kFrame,
+        kInput,
+        // kInputのうち、Playerを物理のstepで動かした時間
+        kPhysics,
+        // kInputのうち、Blockのtick(TNTの導火線、葉の消滅など)を進めた時間
+        kTick,
+        kChunks,
+        // Pipelineで、メインスレッドが描画の終わりを待った時間
+        kWaitRender,
+        kRaycast,
+        // kRaycastのうち、縮小して描いた画を拡大した時間
+        kUpscale,
+        kCursor,
+        kBlit,
+        kHud,
+        kPresent,
+        kNSections,
+    };
+    enum Counter {
+        kRays,
+        kRaySteps,
+        kRayHits,
+        // 前のフレームを再利用して描いたフレームで、調べたpixelとRayを飛ばし直したpixel
+        kCacheLookups,
+        kCacheMisses,
+        // tickで処理したBlockの数
+        kBlockTicks,
+        // tickで爆発したTNTの数
+        kExplosions,
+        kNCounters,
+    };
+    static const char *const kSectionNames[kNSections];
+    static const char *const kCounterNames[kNCounters];
+    // 統計を取る直近のフレーム数
+    static constexpr const int kNFrames = 256;
+    // 書き出す間隔(フレーム数)
+    static constexpr const int kExportInterval = 120;
+
+    using Clock = std::chrono::steady_clock;
+
+    // 生成してから破棄するまでの時間をsectionに足す
+    class Scope {
+    public:
+        Scope(Profiler &profiler, Section section)
+            : profiler_(profiler), section_(section), start_(Clock::now()) { }
+        ~Scope() { profiler_.Add(section_, Clock::now() - start_); }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        Profiler &profiler_;
+        Section section_;
+        Clock::time_point start_;
+    };
+
+    Profiler();
+    ~Profiler();
+    Profiler(const Profiler &) = delete;
+    Profiler &operator=(const Profiler &) = delete;
+
+    void Add(Section section, Clock::duration time) {
+        section_ns_[section].fetch_add(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(time).count(),
+            std::memory_order_relaxed);
+    }
+    void Count(Counter counter, long long n) {
+        counts_[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+    // ここまでに足した時間と数を1フレーム分の記録にする
+    void EndFrame();
+    // 描かずに待った時間を次のフレームの時間に含めないように、kFrameを測り直す
+    void Restart() { last_end_ = Clock::now(); }
+
+    // 直近のフレームの平均と百分位数を1行ずつ
+    void FormatSummary(std::vector<std::string> &lines) const;
+    // kExportIntervalフレームごとに書き出す
+    // pathが.jsonなら直近のフレームの統計を書き直し、それ以外はフレームごとの記録をCSVで足す
+    bool OpenExport(const std::string &path);
+    // まだ書き出していないフレームを書き出す
+    void Export();
+
+private:
+    struct Frame {
+        // 区間ごとの時間(ms)
+        float ms[kNSections];
+        long long counts[kNCounters];
+    };
+    struct Stats {
+        double mean, p50, p95, p99, max;
+    };
+
+    std::atomic<long long> section_ns_[kNSections];
+    std::atomic<long long> counts_[kNCounters];
+    Clock::time_point last_end_;
+
+    // 直近kNFramesフレームの記録(n_frames_番目のフレームはframes_[n_frames_ % kNFrames])
+    std::vector<Frame> frames_;
+    long long n_frames_ = 0;
+
+    std::string export_path_;
+    bool export_json_ = false;
+    std::ofstream csv_;
+    // 書き出し済みのフレーム数
+    long long n_exported_frames_ = 0;
+
+    Stats CalcStats(Section section) const;
+    double CalcCounterMean(Counter counter) const;
+    void ExportCsv();
+    void ExportJson();
+};
@@ -193,13 +193,17 @@ bool keyPressed(int key); //this checks if the key is *just* pressed, returns tr
 ////////////////////////////////////////////////////////////////////////////////
 
 void screen(int width = 640, int height = 400, bool fullscreen = 0, const std::string& text = " ");
+bool screenGL(int width, int height, int windowWidth, int windowHeight, bool fullscreen, const std::string& text = " "); //presents through OpenGL, scaling the screen to the window; false if OpenGL is unavailable
 void lock();
 void unlock();
 void redraw();
+void redraw(int x, int y, int width, int height); //updates only the given rectangle of the screen
 void cls(const ColorRGB& color = RGB_Black);
 void pset(int x, int y, const ColorRGB& color);
 ColorRGB pget(int x, int y);
 void drawBuffer(Uint32* buffer);
+void drawBuffer(Uint32* buffer, int x, int y, int width, int height); //draws only a rectangle of the w*h buffer
+Uint32* getScreenPixels(); //the screen's own w*h pixels if a renderer can write to them directly, otherwise NULL
 bool onScreen(int x, int y);
 
 ////////////////////////////////////////////////////////////////////////////////
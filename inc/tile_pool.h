@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+// 画面をTileに分けて、常駐させたスレッドで描画する
+// 最初は連続したTileを等分して配り、自分の分が終わったスレッドは
+// 他のスレッドの残りの後ろ半分を盗む(Work stealing)
+class TilePool {
+public:
+    // n_threads <= 0 ならハードウェアのスレッド数を使う
+    // Runを呼んだスレッドも0番目のスレッドとして描画する
+    explicit TilePool(int n_threads = 0);
+    ~TilePool();
+    TilePool(const TilePool &) = delete;
+    TilePool &operator=(const TilePool &) = delete;
+
+    int GetNThreads() const { return n_threads_; }
+    // Tile 0 ~ n_tiles - 1をそれぞれrender(tile, thread)で処理し、全て終わるまで待つ
+    void Run(int n_tiles, const std::function<void(int, int)> &render);
+
+    // 直前のRunの統計
+    struct Stats {
+        double mean_tile_ms;
+        double max_tile_ms;
+        // スレッドごとの処理時間(処理したTileの時間の合計)
+        double mean_thread_ms;
+        double max_thread_ms;
+        int n_steals;
+    };
+    const Stats &GetStats() const { return stats_; }
+
+private:
+    // range: 残っているTile[begin, end)を(begin << 32 | end)にまとめたもの
+    // 持ち主は先頭から1つずつ取り、他のスレッドは後ろから盗む
+    struct alignas(64) Worker {
+        std::atomic<uint64_t> range;
+        double busy_time;
+        double max_tile_time;
+        int n_steals;
+    };
+
+    static uint64_t ToRange(uint32_t begin, uint32_t end) {
+        return (uint64_t)begin << 32 | end;
+    }
+
+    int n_threads_;
+    std::unique_ptr<Worker[]> workers_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable start_cv_;
+    std::condition_variable done_cv_;
+    // 以下はmutex_で保護する
+    // generation_: Runのたびに増やし、待っているスレッドに新しい仕事を知らせる
+    unsigned generation_ = 0;
+    int n_running_ = 0;
+    bool quit_ = false;
+    const std::function<void(int, int)> *render_ = nullptr;
+
+    Stats stats_ = {};
+
+    void WorkerLoop(int thread);
+    void Work(int thread);
+    bool PopTile(int thread, int &tile);
+    bool StealTiles(int thread);
+};
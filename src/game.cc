@@ -1,9 +1,13 @@
 #include "game.h"
 
 #include <cstdio>
+#include <cstdlib>
 #include <cmath>
 #include <cassert>
-#include <omp.h>
+#include <chrono>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/rotate_vector.hpp>
@@ -46,6 +50,10 @@ namespace {
         "              @@              ",
     };
 
+    // Headlessで画面サイズが指定されなかったときの解像度
+    const int kHeadlessScreenWidth = 1920;
+    const int kHeadlessScreenHeight = 1080;
+
     void GetScreenResolution(int &width, int &height) {
         Display* disp = XOpenDisplay(NULL);
         Screen*  scrn = DefaultScreenOfDisplay(disp);
@@ -127,8 +135,44 @@ const std::array<std::string, Game::kNBlocks> Game::kBlockName = {
     "Transparent",
 };
 
-Game::Game(int screen_width, int screen_height, bool fullscreen)
-    : fullscreen_(fullscreen), prev_lmb_(false) {
+// 爆発のRayが通るときに減る強さ(TransparentBlockと読み込まれていないChunkは爆発を通さない)
+const std::array<float, Game::kNBlocks> Game::kBlockBlastResistance = {
+    0.0,        // Air
+    0.6,        // Grass
+    3.0,        // Big oak plank
+    0.8,        // Quartz block chiseled
+    6.0,        // Brick
+    2.0,        // Cherry log
+    3.0,        // Cherry plank
+    0.2,        // Cherry leaves
+    6.0,        // Coal block
+    6.0,        // Cracked nether brick
+    2.5,        // Crafting table
+    6.0,        // Stone
+    0.0,        // TNT
+    6.0,        // Reserved1
+    6.0,        // Reserved2
+    6.0,        // Reserved3
+    6.0,        // Reserved4
+    6.0,        // Reserved5
+    6.0,        // Reserved6
+    3600000.0,  // Transparent
+};
+
+// 今のところ光るBlockはない
+const std::array<uint8_t, Game::kNBlocks> Game::kBlockLightEmission = {};
+
+// l = 明るさ / 15として、0.1 + 0.9 * l / (4 - 3 * l)(暗いところの差が小さくなる)
+const std::array<uint16_t, Game::kMaxLight + 1> Game::kLightBrightness = {
+    26, 30, 34, 39, 45, 51, 59, 67, 77, 88, 102, 119, 141, 168, 205, 256,
+};
+
+Game::Game(int screen_width, int screen_height, bool fullscreen, bool headless)
+    : fullscreen_(fullscreen), headless_(headless), prev_lmb_(false) {
+    if (headless_ && (screen_width < 0 || screen_height < 0)) {
+        screen_width = kHeadlessScreenWidth;
+        screen_height = kHeadlessScreenHeight;
+    }
     if (screen_width < 0 || screen_height < 0) {
         GetScreenResolution(screen_width, screen_height);
     }
@@ -137,73 +181,191 @@ Game::Game(int screen_width, int screen_height, bool fullscreen)
 }
 
 void Game::Start() {
+    assert(!headless_);
     Init();
     while (!QuickCG::done()) {
-        Update();
-        HandleInput();
+        if (use_pipeline_) {
+            UpdatePipelined();
+        }
+        else {
+            Update();
+            HandleInput();
+        }
     }
     Quit();
 }
 
-void Game::Init() {
+void Game::Init(int mid) {
     InitScreen();
-    LoadMap(0);
+    LoadMap(mid);
     LoadTexs();
     InitPlayer();
+    // 画面の中心付近で、隣のpixelとのRayの向きの差 * テクスチャの大きさ
+    pixel_footprint_ = 2.0 * glm::length(plane_x_) / screen_width_ * kTexWidth;
+    UpdateChunks(true);
+    tile_pool_.reset(new TilePool(n_threads_));
+    ray_counters_.resize(tile_pool_->GetNThreads());
+    blast_hits_.resize(tile_pool_->GetNThreads());
+    BuildBlastSteps();
+    if (use_pipeline_) {
+        StartRenderThread();
+    }
 }
 
-void Game::InitScreen() {
-    QuickCG::screen(screen_width_, screen_height_, fullscreen_, "Chibicraft");
-    SDL_ShowCursor(false);
-
-    buffer_ = new uint32_t[screen_height_ * screen_width_];
+void Game::SetNThreads(int n_threads) {
+    assert(!tile_pool_);
+    n_threads_ = n_threads;
 }
 
-void Game::LoadMap(int mid) {
-    std::string mfn = ToMapFileName(mid);
+void Game::LockRenderScale(float scale) {
+    assert(0.0 <= scale && scale <= 1.0);
+    locked_render_scale_ = scale;
+}
 
-    std::ifstream ifs(mfn, std::ios::binary);
-    if (!ifs) {
-        std::cerr << "Error: Failed to open map." << std::endl;
-        Quit();
-    }
+void Game::UsePipeline(bool use_pipeline) {
+    assert(!tile_pool_);
+    use_pipeline_ = use_pipeline;
+}
 
-    ifs.seekg(0, std::ios::end);
-    int file_size = ifs.tellg();
-    int map_size = kMapHeight * kMapDepth * kMapWidth;
-    if (file_size < map_size) {
-        std::cerr << "Error: Failed to load map." << std::endl;
-        Quit();
-    }
+bool Game::ExportProfile(const std::string &path) {
+    return profiler_.OpenExport(path);
+}
 
-    ifs.seekg(0);
-    ifs.read(world_map_, map_size);
+void Game::UseOpenGl(bool use_opengl, float internal_scale) {
+    assert(!tile_pool_ && 0.0 < internal_scale && internal_scale <= 1.0);
+    use_opengl_ = use_opengl;
+    opengl_internal_scale_ = internal_scale;
 }
 
-void Game::SaveMap(int mid) {
-    std::string mfn = ToMapFileName(mid);
+void Game::SetViewDist(int view_dist) {
+    view_dist_ = std::max(kMinViewDist, std::min(view_dist, kMaxViewDist));
+    chunk_load_dist_ = ToChunkLoadDist(view_dist_);
+    chunk_load_height_ = std::min(chunk_load_dist_, kMaxChunkLoadHeight);
+    if (!tile_pool_) {
+        return;
+    }
+    // 遊んでいる間に変えたときは、読み込む範囲を変えて描き直す
+    render_cache_valid_ = false;
+    redraw_ = true;
+    redraw_hud_ = true;
+    UpdateChunks(true);
+}
 
-    std::ofstream ofs(mfn, std::ios::binary);
-    if (!ofs) {
-        std::cerr << "Error: Failed to open map." << std::endl;
-        Quit();
+void Game::InitScreen() {
+    window_width_ = screen_width_;
+    window_height_ = screen_height_;
+    if (headless_) {
+        // Headlessでは画面に転送しないので、Pipelineも使わない
+        use_pipeline_ = false;
+    }
+    else {
+        if (use_opengl_) {
+            screen_width_ = std::max(1, (int)(window_width_ * opengl_internal_scale_));
+            screen_height_ = std::max(1, (int)(window_height_ * opengl_internal_scale_));
+            use_opengl_ = QuickCG::screenGL(screen_width_, screen_height_,
+                window_width_, window_height_, fullscreen_, "Chibicraft");
+            if (!use_opengl_) {
+                std::cerr << "Warning: OpenGL is not available, presenting with SDL" << std::endl;
+                screen_width_ = window_width_;
+                screen_height_ = window_height_;
+            }
+        }
+        if (!use_opengl_) {
+            QuickCG::screen(screen_width_, screen_height_, fullscreen_, "Chibicraft");
+        }
+        SDL_ShowCursor(false);
     }
 
-    int map_size = kMapHeight * kMapDepth * kMapWidth;
-    ofs.write(world_map_, map_size);
+    // Pipelineでは転送中の画に描かないように、Surfaceとは別に2枚持つ
+    buffer_ = headless_ || use_pipeline_ ? nullptr : QuickCG::getScreenPixels();
+    if (!buffer_) {
+        own_buffer_.reset(new uint32_t[screen_height_ * screen_width_]);
+        buffer_ = own_buffer_.get();
+    }
+    front_buffer_ = buffer_;
+    if (use_pipeline_) {
+        own_front_buffer_.reset(new uint32_t[screen_height_ * screen_width_]);
+        front_buffer_ = own_front_buffer_.get();
+    }
 }
 
 void Game::LoadTexs() {
+    std::vector<uint32_t> texs[kNTexs];
     unsigned long tw, th, err = 0;
     for (int i = 0; kNTexs > i; i++) {
-        texs_[i].resize(kTexWidth * kTexHeight);
-        err |= QuickCG::loadImage(texs_[i], tw, th, kTexDir + kTexFiles[i]);
+        texs[i].resize(kTexWidth * kTexHeight);
+        err |= QuickCG::loadImage(texs[i], tw, th, kTexDir + kTexFiles[i]);
         if (err) {
             std::cerr << "Error: Failed to load textures: "
                 << kTexFiles[i] << std::endl;
             Quit();
         }
     }
+
+    // テクスチャ * 4通り(左右反転するか, 暗くするか)のうち、使うものだけTileにする
+    std::array<int, kNTexs * 4> variant_tiles;
+    variant_tiles.fill(-1);
+    for (std::vector<TexelLine> &level : tex_atlas_) {
+        level.clear();
+    }
+    int n_tiles = 0;
+    for (int block = 0; kNBlocks > block; block++) {
+        for (int face = 0; 6 > face; face++) {
+            int tex = kBlockToTexs[block] >> (face * 8) & 0xff;
+            if (tex >= kNTexs) {
+                // AirとTransparent Blockは描画しない
+                face_tiles_[block][face] = 0;
+                continue;
+            }
+            // 偶数番目の面(x+面, y+面, z+面)はテクスチャを左右反転する
+            bool mirror = face % 2 == 0;
+            bool shade = face >= 2;
+            int variant = tex * 4 + mirror * 2 + shade;
+            if (variant_tiles[variant] < 0) {
+                int tile = n_tiles++;
+                variant_tiles[variant] = tile;
+                tex_atlas_[0].resize(n_tiles * GetTexLinesPerTile(0));
+                for (int y = 0; kTexHeight > y; y++) {
+                    for (int x = 0; kTexWidth > x; x++) {
+                        // 画像は上から下へ並んでいるので上下も反転する
+                        int tex_x = mirror ? kTexWidth - x - 1 : x;
+                        uint32_t color = texs[tex][kTexWidth * (kTexHeight - y - 1) + tex_x];
+                        if (shade) {
+                            color = (color >> 1) & 0x7F7F7F;
+                        }
+                        SetTexel(0, tile, y * kTexWidth + x, color);
+                    }
+                }
+            }
+            face_tiles_[block][face] = variant_tiles[variant];
+        }
+    }
+
+    // 1つ上の段の2x2 texelを平均して、Mipmapの各段を作る
+    for (int level = 1; kNTexLevels > level; level++) {
+        int size = kTexWidth >> level;
+        tex_atlas_[level].resize(n_tiles * GetTexLinesPerTile(level));
+        for (int tile = 0; n_tiles > tile; tile++) {
+            for (int y = 0; size > y; y++) {
+                for (int x = 0; size > x; x++) {
+                    int i = y * 2 * size * 2 + x * 2;
+                    uint32_t texels[4] = {
+                        GetTexel(level - 1, tile, i), GetTexel(level - 1, tile, i + 1),
+                        GetTexel(level - 1, tile, i + size * 2),
+                        GetTexel(level - 1, tile, i + size * 2 + 1) };
+                    uint32_t color = 0;
+                    for (int shift = 0; 24 > shift; shift += 8) {
+                        uint32_t sum = 2;
+                        for (uint32_t texel : texels) {
+                            sum += texel >> shift & 0xFF;
+                        }
+                        color |= (sum / 4) << shift;
+                    }
+                    SetTexel(level, tile, y * size + x, color);
+                }
+            }
+        }
+    }
 }
 
 void Game::InitPlayer() {
@@ -212,23 +374,248 @@ void Game::InitPlayer() {
     dir_ = glm::vec3(0.0, 0.0, 1.0);
     plane_x_ = glm::vec3(0.66, 0.0, 0.0);
     plane_y_ = glm::vec3(0.0, 0.4125, 0.0);
+
+    player_pos_ = pos_;
+    prev_player_pos_ = pos_;
+    velocity_ = glm::vec3(0.0, 0.0, 0.0);
+    on_ground_ = false;
+    move_input_ = glm::vec3(0.0, 0.0, 0.0);
+    jump_input_ = false;
+    physics_time_ = 0.0;
+    physics_ticks_ = QuickCG::getTicks();
 }
 
 void Game::Update() {
-    SlackOffRaycasting();
-    // SimpleRaycasting();
-    DrawCursor();
+    {
+        Profiler::Scope scope(profiler_, Profiler::kChunks);
+        UpdateChunks();
+    }
+    if (!redraw_) {
+        if (redraw_hud_) {
+            RedrawHud();
+        }
+        else {
+            // 何も変わっていなければ前のフレームのまま、入力が来るまで眠る
+            WaitInput(kIdleTimeout);
+        }
+        // 待った時間は次のフレームの時間に含めない(移動や回転の速さがずれるので)
+        time_ = QuickCG::getTicks();
+        profiler_.Restart();
+        return;
+    }
+    redraw_ = false;
+    redraw_hud_ = false;
 
-    QuickCG::drawBuffer(buffer_);
+    render_frame_time_ = frame_time_;
+    RenderFrame();
+    hud_render_scale_ = GetRenderScale();
+    PresentFrame();
+}
+
+void Game::UpdatePipelined() {
+    // 前に依頼したフレームが描き終わるのを待ち、転送する側と入れ替える
+    bool rendered;
+    {
+        Profiler::Scope scope(profiler_, Profiler::kWaitRender);
+        rendered = WaitRender();
+    }
+    if (rendered) {
+        std::swap(buffer_, front_buffer_);
+        hud_render_scale_ = GetRenderScale();
+    }
+
+    // 描画中はMapやカメラを変えられないので、入力は次のフレームを描き始める直前に読む
+    HandleInput();
+    {
+        Profiler::Scope scope(profiler_, Profiler::kChunks);
+        UpdateChunks();
+    }
+    bool rendering = redraw_;
+    if (redraw_) {
+        redraw_ = false;
+        RequestRender();
+    }
+
+    // 次のフレームを描いている間に、描き終えたフレームを転送する
+    if (rendered) {
+        redraw_hud_ = false;
+        PresentFrame();
+        return;
+    }
+    if (!rendering) {
+        if (redraw_hud_) {
+            RedrawHud();
+        }
+        else {
+            WaitInput(kIdleTimeout);
+        }
+    }
+    // 転送しなかった時間は次のフレームの時間に含めない
+    time_ = QuickCG::getTicks();
+    profiler_.Restart();
+}
+
+void Game::RenderFrame() {
+    {
+        Profiler::Scope scope(profiler_, Profiler::kRaycast);
+        AdaptiveRaycasting();
+        // SlackOffRaycasting();
+        // SimpleRaycasting();
+        // PacketRaycasting();
+        // EdgeAwareRaycasting();
+    }
+    profiler_.Count(Profiler::kRays, n_rays_);
+    profiler_.Count(Profiler::kRaySteps, n_ray_steps_);
+    profiler_.Count(Profiler::kRayHits, n_hits_);
+    {
+        Profiler::Scope scope(profiler_, Profiler::kCursor);
+        DrawCursor();
+    }
+}
+
+void Game::PresentFrame() {
+    {
+        Profiler::Scope scope(profiler_, Profiler::kBlit);
+        QuickCG::drawBuffer(front_buffer_);
+    }
 
     old_time_ = time_;
     time_ = QuickCG::getTicks();
     frame_time_ = (time_ - old_time_) / 1000.0;
-    QuickCG::print(1.0 / frame_time_, 20, 20, QuickCG::RGB_Black);
+    {
+        Profiler::Scope scope(profiler_, Profiler::kHud);
+        SaveHudBackground();
+        DrawHud();
+        if (show_profile_) {
+            DrawProfile();
+        }
+    }
+
+    {
+        Profiler::Scope scope(profiler_, Profiler::kPresent);
+        QuickCG::redraw();
+    }
+    profiler_.EndFrame();
+}
+
+void Game::StartRenderThread() {
+    render_quit_ = false;
+    render_thread_ = std::thread(&Game::RenderThreadLoop, this);
+}
+
+void Game::StopRenderThread() {
+    if (!render_thread_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(render_mutex_);
+        render_quit_ = true;
+    }
+    render_cv_.notify_one();
+    // 依頼済みのフレームは描き終えてから止まる
+    render_thread_.join();
+    render_pending_ = false;
+}
+
+void Game::RenderThreadLoop() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(render_mutex_);
+            render_cv_.wait(lock, [this] { return render_quit_ || render_requested_; });
+            if (!render_requested_) {
+                return;
+            }
+        }
+        RenderFrame();
+        {
+            std::lock_guard<std::mutex> lock(render_mutex_);
+            render_requested_ = false;
+        }
+        render_done_cv_.notify_one();
+    }
+}
+
+void Game::RequestRender() {
+    assert(!render_pending_);
+    render_frame_time_ = frame_time_;
+    {
+        std::lock_guard<std::mutex> lock(render_mutex_);
+        render_requested_ = true;
+    }
+    render_pending_ = true;
+    render_cv_.notify_one();
+}
+
+bool Game::WaitRender() {
+    if (!render_pending_) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(render_mutex_);
+    render_done_cv_.wait(lock, [this] { return !render_requested_; });
+    render_pending_ = false;
+    return true;
+}
+
+void Game::SaveHudBackground() {
+    hud_background_.resize(kHudWidth * kHudHeight);
+    for (int y = 0; kHudHeight > y; y++) {
+        for (int x = 0; kHudWidth > x; x++) {
+            if (kHudX + x < screen_width_ && kHudY + y < screen_height_) {
+                hud_background_[kHudWidth * y + x] =
+                    front_buffer_[screen_width_ * (kHudY + y) + kHudX + x];
+            }
+        }
+    }
+}
+
+void Game::RestoreHudBackground() {
+    for (int y = 0; kHudHeight > y; y++) {
+        for (int x = 0; kHudWidth > x; x++) {
+            if (kHudX + x < screen_width_ && kHudY + y < screen_height_) {
+                front_buffer_[screen_width_ * (kHudY + y) + kHudX + x] =
+                    hud_background_[kHudWidth * y + x];
+            }
+        }
+    }
+    QuickCG::drawBuffer(front_buffer_, kHudX, kHudY, kHudWidth, kHudHeight);
+}
 
-    QuickCG::print(kBlockName[select_block_], 20, 40, QuickCG::RGB_Black);
+void Game::DrawHud() {
+    QuickCG::print(1.0 / frame_time_, kHudX, kHudY, QuickCG::RGB_Black);
+    QuickCG::print(kBlockName[select_block_], kHudX, kHudY + 20, QuickCG::RGB_Black);
+    std::ostringstream scale;
+    scale << "x" << std::setprecision(2) << hud_render_scale_ << "  view " << view_dist_;
+    QuickCG::print(scale.str(), kHudX, kHudY + 40, QuickCG::RGB_Black);
+}
+
+void Game::DrawProfile() {
+    std::vector<std::string> lines;
+    profiler_.FormatSummary(lines);
+    int y = kHudY + kHudHeight;
+    for (const std::string &line : lines) {
+        QuickCG::print(line, kHudX, y, QuickCG::RGB_Black, true, QuickCG::RGB_White);
+        y += 10;
+    }
+}
 
-    QuickCG::redraw();
+void Game::RedrawHud() {
+    redraw_hud_ = false;
+    RestoreHudBackground();
+    DrawHud();
+    QuickCG::redraw(kHudX, kHudY, kHudWidth, kHudHeight);
+}
+
+void Game::WaitInput(float timeout) {
+    // SDL 1.2のSDL_WaitEventにはtimeoutがないので、イベントが来るまで少しずつ眠る
+    Uint32 end = SDL_GetTicks() + (Uint32)(timeout * 1000.0);
+    while (SDL_GetTicks() < end) {
+        SDL_PumpEvents();
+        SDL_Event event;
+        if (SDL_PeepEvents(&event, 1, SDL_PEEKEVENT, SDL_ALLEVENTS) > 0) {
+            return;
+        }
+        SDL_Delay(5);
+    }
 }
 
 void Game::DrawCursor() {
@@ -245,94 +632,559 @@ void Game::DrawCursor() {
     }
 }
 
-bool Game::CastRay(int x, int y, Ray &ray) const {
+namespace {
+    // 距離distまでにRayがある軸の境界を越える回数(max_nまで)
+    // inclusive: 距離がちょうどdistの境界も含めるか
+    inline int CountCrossings(float side_dist, float abs_dir, float dist,
+        int max_n, bool inclusive) {
+        if (side_dist > dist) {
+            return 0;
+        }
+        // delta_dist = 1 / |dir|なので、割り算の代わりに|dir|を掛ける
+        // m >= 0なので、intへの変換は切り捨てになる
+        float m = (dist - side_dist) * abs_dir;
+        int n = (int)m;
+        n += inclusive ? 1 : (n < m);
+        return std::min(n, max_n);
+    }
+}
+
+inline int Game::SkipEmptyCell(int cell_size, const glm::ivec3 &step,
+    const glm::vec3 &dir, const glm::vec3 &delta_dist, glm::vec3 &side_dist,
+    glm::ivec3 &pos, float max_dist) {
+    // 各軸について、Cellを出るまでに進むVoxelの数と、Cellの境界を越える距離
+    int mask = cell_size - 1;
+    int n_x = step.x > 0 ? cell_size - (pos.x & mask) : (pos.x & mask) + 1;
+    int n_y = step.y > 0 ? cell_size - (pos.y & mask) : (pos.y & mask) + 1;
+    int n_z = step.z > 0 ? cell_size - (pos.z & mask) : (pos.z & mask) + 1;
+    float exit_dist_x = side_dist.x + (n_x - 1) * delta_dist.x;
+    float exit_dist_y = side_dist.y + (n_y - 1) * delta_dist.y;
+    float exit_dist_z = side_dist.z + (n_z - 1) * delta_dist.z;
+
+    // 最初にCellを出る軸まで進め、他の軸はそれまでに越える境界の数だけ進める
+    // 距離が等しいときは、1Voxelずつ進めるときと同様にx, y, zの順に進む
+    int side;
+    if (exit_dist_x <= exit_dist_y && exit_dist_x <= exit_dist_z) {
+        if (exit_dist_x > max_dist) {
+            return -1;
+        }
+        side = 0;
+        n_y = CountCrossings(side_dist.y, std::abs(dir.y), exit_dist_x, n_y - 1, false);
+        n_z = CountCrossings(side_dist.z, std::abs(dir.z), exit_dist_x, n_z - 1, false);
+    }
+    else if (exit_dist_y <= exit_dist_z) {
+        if (exit_dist_y > max_dist) {
+            return -1;
+        }
+        side = 1;
+        n_x = CountCrossings(side_dist.x, std::abs(dir.x), exit_dist_y, n_x - 1, true);
+        n_z = CountCrossings(side_dist.z, std::abs(dir.z), exit_dist_y, n_z - 1, false);
+    }
+    else {
+        if (exit_dist_z > max_dist) {
+            return -1;
+        }
+        side = 2;
+        n_x = CountCrossings(side_dist.x, std::abs(dir.x), exit_dist_z, n_x - 1, true);
+        n_y = CountCrossings(side_dist.y, std::abs(dir.y), exit_dist_z, n_y - 1, true);
+    }
+    pos += step * glm::ivec3(n_x, n_y, n_z);
+    side_dist += delta_dist * glm::vec3(n_x, n_y, n_z);
+    return side;
+}
+
+bool Game::CastRay(float x, float y, Ray &ray) const {
+    RayDda dda;
+    InitRay(x, y, ray, dda);
+    return TraceRay(ray, dda);
+}
+
+inline glm::vec3 Game::CalcRayDir(float x, float y) const {
     float camera_y = 2.0 * y / screen_height_ - 1;
     float camera_x = 2.0 * x / screen_width_ - 1;
+    return dir_ + plane_x_ * camera_x + plane_y_ * camera_y;
+}
+
+inline void Game::InitRay(float x, float y, Ray &ray, RayDda &dda) const {
+    ray.dir = CalcRayDir(x, y);
+    dda.pos = glm::floor(pos_);
+    for (int i = 0; 3 > i; i++) {
+        dda.delta_dist[i] = (ray.dir[i] == 0) ? 1e30 : std::abs(1 / ray.dir[i]);
+        if (ray.dir[i] < 0) {
+            dda.step[i] = -1;
+            dda.side_dist[i] = (pos_[i] - dda.pos[i]) * dda.delta_dist[i];
+        }
+        else {
+            dda.step[i] = 1;
+            dda.side_dist[i] = (dda.pos[i] + 1.0 - pos_[i]) * dda.delta_dist[i];
+        }
+    }
+    dda.side = 0;
+    dda.n_steps = 0;
+}
+
+bool Game::TraceRay(Ray &ray, RayDda dda) const {
+    const glm::vec3 delta_dist = dda.delta_dist;
+    const glm::ivec3 step = dda.step;
+    glm::vec3 side_dist = dda.side_dist;
+    // Rayの状態はループ中レジスタに載るようにローカル変数で持つ
+    glm::ivec3 pos = dda.pos;
+    int side = dda.side;
+    int n_steps = dda.n_steps;
+    // kLodDistより遠くはTraceLodRayで進める
+    const float max_dist = GetLodEndDist(0);
+    // Brick, Chunkに入ったとき、進んだ軸のBrick, Chunk内の座標
+    // (進む向きによって0か一辺の長さ-1になる)
+    glm::ivec3 brick_entry, chunk_entry;
+    for (int i = 0; 3 > i; i++) {
+        brick_entry[i] = step[i] > 0 ? 0 : kBrickMask;
+        chunk_entry[i] = step[i] > 0 ? 0 : kChunkMask;
+    }
+    // 読み込まれていないChunkは空のChunkとして通り抜ける
+    const Chunk *chunk = FindChunk(ToChunkPos(pos));
+    uint64_t brick_mask = chunk
+        ? chunk->brick_masks[ToBrickIndex(pos.x, pos.y, pos.z)] : 0;
+    bool hit = false;
+    while (!hit) {
+        bool enter_brick, enter_chunk;
+        if (brick_mask == 0) {
+            // 空のBrick(Chunkごと空ならChunk)を一度に抜ける
+            int cell_size = !chunk || chunk->n_solid_blocks == 0
+                ? kChunkSize : kBrickSize;
+            int skip_side = SkipEmptyCell(cell_size, step, ray.dir, delta_dist,
+                side_dist, pos, max_dist);
+            if (skip_side < 0) {
+                break;
+            }
+            side = skip_side;
+            enter_brick = true;
+            enter_chunk = true;
+        }
+        else if (side_dist.x <= side_dist.y
+         && side_dist.x <= side_dist.z
+         && side_dist.x <= max_dist) {
+            side_dist.x += delta_dist.x;
+            pos.x += step.x;
+            side = 0;
+            enter_brick = (pos.x & kBrickMask) == brick_entry.x;
+            enter_chunk = (pos.x & kChunkMask) == chunk_entry.x;
+        }
+        else if (side_dist.y <= side_dist.z
+              && side_dist.y <= max_dist) {
+            side_dist.y += delta_dist.y;
+            pos.y += step.y;
+            side = 1;
+            enter_brick = (pos.y & kBrickMask) == brick_entry.y;
+            enter_chunk = (pos.y & kChunkMask) == chunk_entry.y;
+        }
+        else if (side_dist.z <= max_dist) {
+            side_dist.z += delta_dist.z;
+            pos.z += step.z;
+            side = 2;
+            enter_brick = (pos.z & kBrickMask) == brick_entry.z;
+            enter_chunk = (pos.z & kChunkMask) == chunk_entry.z;
+        }
+        else {
+            break;
+        }
+        n_steps++;
+        if (enter_chunk) {
+            chunk = FindChunk(ToChunkPos(pos));
+        }
+        if (enter_brick) {
+            brick_mask = chunk
+                ? chunk->brick_masks[ToBrickIndex(pos.x, pos.y, pos.z)] : 0;
+        }
+        hit = brick_mask & ToBrickBit(pos.x, pos.y, pos.z);
+    }
+    if (hit) {
+        ray.block = chunk->blocks[ToChunkIndex(pos.x, pos.y, pos.z)];
+    }
+    else if (max_dist < view_dist_) {
+        dda.pos = pos;
+        dda.side = side;
+        dda.n_steps = n_steps;
+        return TraceLodRay(ray, dda);
+    }
+
+    ray.pos = pos;
+    ray.collision_side = side;
+    ray.n_steps = n_steps;
+    ray.perp_wall_dist = side_dist[side] - delta_dist[side];
+    ray.max_perp_wall_dist = view_dist_ - delta_dist[side];
 
-    ray.dir = dir_ + plane_x_ * camera_x + plane_y_ * camera_y;
-    ray.pos = pos_;
+    return hit;
+}
 
-    float delta_dist_x = (ray.dir.x == 0) ? 1e30 : std::abs(1 / ray.dir.x);
-    float delta_dist_y = (ray.dir.y == 0) ? 1e30 : std::abs(1 / ray.dir.y);
-    float delta_dist_z = (ray.dir.z == 0) ? 1e30 : std::abs(1 / ray.dir.z);
+bool Game::TraceLodRay(Ray &ray, RayDda dda) const {
+    const glm::ivec3 step = dda.step;
+    glm::ivec3 pos = dda.pos;
+    int side = dda.side;
+    int n_steps = dda.n_steps;
+    glm::vec3 side_dist, delta_dist;
+    bool hit = false;
+    int level = 0;
+    while (!hit && kNLodLevels > level) {
+        // 1段粗い格子に移り、今いるセルの境界までの距離を求め直す
+        level++;
+        for (int i = 0; 3 > i; i++) {
+            pos[i] >>= 1;
+            int bound = (pos[i] + (step[i] > 0)) << level;
+            side_dist[i] = std::abs(bound - pos_[i]) * dda.delta_dist[i];
+            delta_dist[i] = dda.delta_dist[i] * (1 << level);
+        }
+        const float max_dist = GetLodEndDist(level);
+        // Chunkの一辺のセルの数は1 << cell_shift
+        const int cell_shift = kChunkShift - level;
+        const int cell_mask = (1 << cell_shift) - 1;
+        // 空のBrickを抜けるときに進む一辺(段2, 3ではChunk全体)
+        // Chunkごと空ならChunkを一度に抜ける
+        const int brick_size = std::min(kBrickSize, 1 << cell_shift);
+        // SkipEmptyCellは1 / |dir|をセルの一辺とみなして境界を数えるので、
+        // 一辺2^levelのセルに合わせてdirを縮める
+        const glm::vec3 cell_dir = ray.dir / (float)(1 << level);
+        glm::ivec3 chunk_entry;
+        for (int i = 0; 3 > i; i++) {
+            chunk_entry[i] = step[i] > 0 ? 0 : cell_mask;
+        }
+        const Chunk *chunk = FindChunk(glm::ivec3(
+            pos.x >> cell_shift, pos.y >> cell_shift, pos.z >> cell_shift));
+        uint64_t brick_mask = chunk
+            ? chunk->lod_brick_masks[ToLodBrickIndex(level, pos.x, pos.y, pos.z)] : 0;
+        // 今いるセルは通り抜けてきたVoxelより先にも広がっているので、先に調べる
+        // 当たっていれば、Rayがこのセルに入った面に当たったとする
+        hit = brick_mask & ToLodBrickBit(level, pos.x, pos.y, pos.z);
+        if (hit) {
+            for (int i = 0; 3 > i; i++) {
+                if (side_dist[i] - delta_dist[i] > side_dist[side] - delta_dist[side]) {
+                    side = i;
+                }
+            }
+        }
+        while (!hit) {
+            bool enter_chunk;
+            if (brick_mask == 0) {
+                int cell_size = !chunk || chunk->n_solid_blocks == 0
+                    ? 1 << cell_shift : brick_size;
+                int skip_side = SkipEmptyCell(cell_size, step, cell_dir, delta_dist,
+                    side_dist, pos, max_dist);
+                if (skip_side < 0) {
+                    break;
+                }
+                side = skip_side;
+                enter_chunk = true;
+            }
+            else if (side_dist.x <= side_dist.y
+             && side_dist.x <= side_dist.z
+             && side_dist.x <= max_dist) {
+                side_dist.x += delta_dist.x;
+                pos.x += step.x;
+                side = 0;
+                enter_chunk = (pos.x & cell_mask) == chunk_entry.x;
+            }
+            else if (side_dist.y <= side_dist.z
+                  && side_dist.y <= max_dist) {
+                side_dist.y += delta_dist.y;
+                pos.y += step.y;
+                side = 1;
+                enter_chunk = (pos.y & cell_mask) == chunk_entry.y;
+            }
+            else if (side_dist.z <= max_dist) {
+                side_dist.z += delta_dist.z;
+                pos.z += step.z;
+                side = 2;
+                enter_chunk = (pos.z & cell_mask) == chunk_entry.z;
+            }
+            else {
+                break;
+            }
+            n_steps++;
+            if (enter_chunk) {
+                chunk = FindChunk(glm::ivec3(
+                    pos.x >> cell_shift, pos.y >> cell_shift, pos.z >> cell_shift));
+            }
+            brick_mask = chunk
+                ? chunk->lod_brick_masks[ToLodBrickIndex(level, pos.x, pos.y, pos.z)] : 0;
+            hit = brick_mask & ToLodBrickBit(level, pos.x, pos.y, pos.z);
+        }
+        if (hit) {
+            ray.block = chunk->lod_blocks[ToLodIndex(level, pos.x, pos.y, pos.z)];
+        }
+        if (max_dist >= view_dist_) {
+            break;
+        }
+    }
 
-    int step_x, step_y, step_z;
-    float side_dist_x, side_dist_y, side_dist_z;
-    if (ray.dir.x < 0) {
-        step_x = -1;
-        side_dist_x = (pos_.x - ray.pos.x) * delta_dist_x;
+    // 当たった面に接するセルの頂点のVoxelを、当たったBlockとする
+    // (HitSameFaceが面の位置を求められ、同じ面に当たったpixelは同じposになる)
+    ray.pos = glm::ivec3(pos.x << level, pos.y << level, pos.z << level);
+    if (step[side] < 0) {
+        ray.pos[side] += (1 << level) - 1;
     }
-    else {
-        step_x = 1;
-        side_dist_x = (ray.pos.x + 1.0 - pos_.x) * delta_dist_x;
+    ray.collision_side = side;
+    ray.n_steps = n_steps;
+    ray.perp_wall_dist = side_dist[side] - delta_dist[side];
+    ray.max_perp_wall_dist = view_dist_ - dda.delta_dist[side];
+
+    return hit;
+}
+
+#ifdef __SSE2__
+namespace {
+    // SSE2にはblendがないので、maskで選ぶ
+    inline __m128 Select(__m128 mask, __m128 a, __m128 b) {
+        return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
     }
-    if (ray.dir.y < 0) {
-        step_y = -1;
-        side_dist_y = (pos_.y - ray.pos.y) * delta_dist_y;
+    inline __m128i Select(__m128i mask, __m128i a, __m128i b) {
+        return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
     }
-    else {
-        step_y = 1;
-        side_dist_y = (ray.pos.y + 1.0 - pos_.y) * delta_dist_y;
+
+    // CountCrossingsの4本分(inclusiveもRayごとのmask)
+    inline __m128i CountCrossings4(__m128 side_dist, __m128 abs_dir, __m128 dist,
+        __m128i max_n, __m128i inclusive) {
+        __m128 m = _mm_mul_ps(_mm_sub_ps(dist, side_dist), abs_dir);
+        __m128i n = _mm_cvttps_epi32(m);
+        // 比較の結果は-1なので、引くと1を足したことになる
+        __m128i frac = _mm_castps_si128(_mm_cmplt_ps(_mm_cvtepi32_ps(n), m));
+        n = _mm_sub_epi32(n, Select(inclusive, _mm_set1_epi32(-1), frac));
+        n = Select(_mm_cmplt_epi32(max_n, n), max_n, n);
+        return _mm_andnot_si128(_mm_castps_si128(_mm_cmpgt_ps(side_dist, dist)), n);
     }
-    if (ray.dir.z < 0) {
-        step_z = -1;
-        side_dist_z = (pos_.z - ray.pos.z) * delta_dist_z;
+}
+
+int Game::CastRayPacket(int x, int y, Ray rays[4]) const {
+    // 4本のRayを各レーンに載せ、TraceRayの1回分(1Voxel進むか空のCellを抜ける)を
+    // まとめて行う。隣り合うpixelのRayは同じBrickを通ることが多いので、
+    // 4本が同じBrickにいる間はChunk, Brickを1回だけ引き、分かれたら1本ずつ進める
+    RayDda ddas[4];
+    for (int i = 0; 4 > i; i++) {
+        InitRay(x + i % 2, y + i / 2, rays[i], ddas[i]);
     }
-    else {
-        step_z = 1;
-        side_dist_z = (ray.pos.z + 1.0 - pos_.z) * delta_dist_z;
+
+    __m128 side_dist[3], delta_dist[3], abs_dir[3];
+    // neg: stepが負の軸では-1
+    __m128i pos[3], neg[3];
+    for (int a = 0; 3 > a; a++) {
+        side_dist[a] = _mm_setr_ps(ddas[0].side_dist[a], ddas[1].side_dist[a],
+            ddas[2].side_dist[a], ddas[3].side_dist[a]);
+        delta_dist[a] = _mm_setr_ps(ddas[0].delta_dist[a], ddas[1].delta_dist[a],
+            ddas[2].delta_dist[a], ddas[3].delta_dist[a]);
+        abs_dir[a] = _mm_setr_ps(std::abs(rays[0].dir[a]), std::abs(rays[1].dir[a]),
+            std::abs(rays[2].dir[a]), std::abs(rays[3].dir[a]));
+        pos[a] = _mm_set1_epi32(ddas[0].pos[a]);
+        neg[a] = _mm_setr_epi32(-(ddas[0].step[a] < 0), -(ddas[1].step[a] < 0),
+            -(ddas[2].step[a] < 0), -(ddas[3].step[a] < 0));
     }
+    const __m128i ones = _mm_set1_epi32(1);
+    const __m128i all = _mm_set1_epi32(-1);
+    // kLodDistより遠くへ進むRayは、最後にTraceLodRayで1本ずつ進める
+    const __m128 max_dist = _mm_set1_ps(GetLodEndDist(0));
+    const bool use_lod = GetLodEndDist(0) < view_dist_;
+    __m128i side = _mm_setzero_si128();
+    __m128i n_steps = _mm_setzero_si128();
 
-    bool hit = false;
-    while (!hit) {
-        if (side_dist_x <= side_dist_y
-         && side_dist_x <= side_dist_z
-         && side_dist_x <= kMaxRayDist) {
-            side_dist_x += delta_dist_x;
-            ray.pos.x += step_x;
-            ray.collision_side = 0;
-        }
-        else if (side_dist_y <= side_dist_z
-              && side_dist_y <= kMaxRayDist) {
-            side_dist_y += delta_dist_y;
-            ray.pos.y += step_y;
-            ray.collision_side = 1;
-        }
-        else if (side_dist_z <= kMaxRayDist) {
-            side_dist_z += delta_dist_z;
-            ray.pos.z += step_z;
-            ray.collision_side = 2;
+    // 読み込まれていないChunkはempty_chunk_として通り抜ける
+    const Chunk *chunks[4];
+    alignas(16) int pos_x[4], pos_y[4], pos_z[4], bits[4];
+    const Chunk *chunk = FindChunk(ToChunkPos(ddas[0].pos));
+    if (!chunk) {
+        chunk = &empty_chunk_;
+    }
+    uint64_t brick_mask =
+        chunk->brick_masks[ToBrickIndex(ddas[0].pos.x, ddas[0].pos.y, ddas[0].pos.z)];
+    // 4本が同じBrickにいる間だけまとめて進めるので、Cellの大きさは4本で同じ
+    int cell_size = brick_mask != 0 ? 1
+        : chunk->n_solid_blocks == 0 ? kChunkSize : kBrickSize;
+    for (int i = 0; 4 > i; i++) {
+        chunks[i] = chunk;
+    }
+
+    // active: まだ進んでいるRay, hits: 衝突したRay, far: kLodDistに達したRay
+    int active = 0xf;
+    int hits = 0;
+    int far = 0;
+    // 2本以上残っている間はまとめて進め、残りは1本ずつTraceRayで進める
+    while (active & (active - 1)) {
+        __m128 is_x, is_y, dist;
+        __m128i n[3];
+        if (cell_size == 1) {
+            // 4本とも1Voxel進む(距離が等しいときはx, y, zの順に進む)
+            is_x = _mm_and_ps(_mm_cmple_ps(side_dist[0], side_dist[1]),
+                _mm_cmple_ps(side_dist[0], side_dist[2]));
+            is_y = _mm_andnot_ps(is_x, _mm_cmple_ps(side_dist[1], side_dist[2]));
+            dist = Select(is_x, side_dist[0], Select(is_y, side_dist[1], side_dist[2]));
+            n[0] = _mm_and_si128(_mm_castps_si128(is_x), ones);
+            n[1] = _mm_and_si128(_mm_castps_si128(is_y), ones);
+            n[2] = _mm_andnot_si128(_mm_castps_si128(_mm_or_ps(is_x, is_y)), ones);
         }
         else {
+            // 一辺cell_sizeの空のCellを抜ける(SkipEmptyCellと同じ計算)
+            __m128i cells = _mm_set1_epi32(cell_size);
+            __m128i cell_mask = _mm_sub_epi32(cells, ones);
+            __m128 exit_dist[3];
+            for (int a = 0; 3 > a; a++) {
+                __m128i in_cell = _mm_and_si128(pos[a], cell_mask);
+                n[a] = Select(neg[a], _mm_add_epi32(in_cell, ones),
+                    _mm_sub_epi32(cells, in_cell));
+                exit_dist[a] = _mm_add_ps(side_dist[a], _mm_mul_ps(
+                    _mm_cvtepi32_ps(_mm_sub_epi32(n[a], ones)), delta_dist[a]));
+            }
+            is_x = _mm_and_ps(_mm_cmple_ps(exit_dist[0], exit_dist[1]),
+                _mm_cmple_ps(exit_dist[0], exit_dist[2]));
+            is_y = _mm_andnot_ps(is_x, _mm_cmple_ps(exit_dist[1], exit_dist[2]));
+            dist = Select(is_x, exit_dist[0], Select(is_y, exit_dist[1], exit_dist[2]));
+            __m128i mx = _mm_castps_si128(is_x);
+            __m128i my = _mm_castps_si128(is_y);
+            __m128i mz = _mm_andnot_si128(_mm_or_si128(mx, my), all);
+            n[0] = Select(mx, n[0], CountCrossings4(side_dist[0], abs_dir[0], dist,
+                _mm_sub_epi32(n[0], ones), _mm_or_si128(my, mz)));
+            n[1] = Select(my, n[1], CountCrossings4(side_dist[1], abs_dir[1], dist,
+                _mm_sub_epi32(n[1], ones), mz));
+            n[2] = Select(mz, n[2], CountCrossings4(side_dist[2], abs_dir[2], dist,
+                _mm_sub_epi32(n[2], ones), _mm_setzero_si128()));
+        }
+        int over = active & _mm_movemask_ps(_mm_cmpgt_ps(dist, max_dist));
+        int live = active & ~over;
+        far |= over;
+        if (live == 0) {
+            active = 0;
             break;
         }
-        if (ray.pos.x < 0 || ray.pos.x >= kMapWidth ||
-            ray.pos.y < 0 || ray.pos.y >= kMapHeight ||
-            ray.pos.z < 0 || ray.pos.z >= kMapDepth) {
+        __m128i live_mask = _mm_setr_epi32(-(live & 1), -(live >> 1 & 1),
+            -(live >> 2 & 1), -(live >> 3 & 1));
+        for (int a = 0; 3 > a; a++) {
+            // 終わったRayは進めない
+            n[a] = _mm_and_si128(n[a], live_mask);
+            pos[a] = _mm_add_epi32(pos[a],
+                _mm_sub_epi32(_mm_xor_si128(n[a], neg[a]), neg[a]));
+            side_dist[a] = _mm_add_ps(side_dist[a],
+                _mm_mul_ps(delta_dist[a], _mm_cvtepi32_ps(n[a])));
+        }
+        __m128i new_side = Select(_mm_castps_si128(is_x), _mm_setzero_si128(),
+            Select(_mm_castps_si128(is_y), ones, _mm_set1_epi32(2)));
+        side = Select(live_mask, new_side, side);
+        n_steps = _mm_sub_epi32(n_steps, live_mask);
+
+        // ToBrickBitのbitの番号
+        const __m128i brick_mask_v = _mm_set1_epi32(kBrickMask);
+        __m128i bit = _mm_or_si128(_mm_slli_epi32(_mm_add_epi32(
+            _mm_slli_epi32(_mm_and_si128(pos[1], brick_mask_v), kBrickShift),
+            _mm_and_si128(pos[0], brick_mask_v)), kBrickShift),
+            _mm_and_si128(pos[2], brick_mask_v));
+        _mm_store_si128(reinterpret_cast<__m128i *>(pos_x), pos[0]);
+        _mm_store_si128(reinterpret_cast<__m128i *>(pos_y), pos[1]);
+        _mm_store_si128(reinterpret_cast<__m128i *>(pos_z), pos[2]);
+        _mm_store_si128(reinterpret_cast<__m128i *>(bits), bit);
+
+        // 進んでいるRayが全て同じBrickにいれば、Chunk, Brickは1回だけ引けばよい
+        int first = __builtin_ctz(live);
+        const int *lane_pos[3] = { pos_x, pos_y, pos_z };
+        __m128i same = all;
+        for (int a = 0; 3 > a; a++) {
+            same = _mm_and_si128(same, _mm_cmpeq_epi32(
+                _mm_srai_epi32(pos[a], kBrickShift),
+                _mm_set1_epi32(lane_pos[a][first] >> kBrickShift)));
+        }
+        int hit_bits = 0;
+        if (((_mm_movemask_ps(_mm_castsi128_ps(same)) | ~live) & 0xf) != 0xf) {
+            // 別々のBrickに分かれたら、この位置を調べてから1本ずつTraceRayで進める
+            for (int i = 0; 4 > i; i++) {
+                if (live >> i & 1) {
+                    const Chunk *chunk =
+                        FindChunk(ToChunkPos(pos_x[i], pos_y[i], pos_z[i]));
+                    chunks[i] = chunk ? chunk : &empty_chunk_;
+                    uint64_t brick_mask = chunks[i]->brick_masks[
+                        ToBrickIndex(pos_x[i], pos_y[i], pos_z[i])];
+                    hit_bits |= (brick_mask >> bits[i] & 1) << i;
+                }
+            }
+            hits |= hit_bits;
+            active = live & ~hit_bits;
             break;
         }
-        int block = GetMapBlock(ray.pos);
-        hit = block != kAirBlock && block != kTransparentBlock;
+        const Chunk *chunk =
+            FindChunk(ToChunkPos(pos_x[first], pos_y[first], pos_z[first]));
+        if (!chunk) {
+            chunk = &empty_chunk_;
+        }
+        uint64_t brick_mask = chunk->brick_masks[
+            ToBrickIndex(pos_x[first], pos_y[first], pos_z[first])];
+        cell_size = brick_mask != 0 ? 1
+            : chunk->n_solid_blocks == 0 ? kChunkSize : kBrickSize;
+        for (int i = 0; 4 > i; i++) {
+            // 止まったRayのChunkは衝突したBlockを引くために残す
+            chunks[i] = live >> i & 1 ? chunk : chunks[i];
+            hit_bits |= (brick_mask >> bits[i] & 1) << i;
+        }
+        hits |= hit_bits & live;
+        active = live & ~hit_bits;
     }
 
-    if (ray.collision_side == 0) {
-        ray.perp_wall_dist = (side_dist_x - delta_dist_x);
-        ray.max_perp_wall_dist = (kMaxRayDist - delta_dist_x);
-    }
-    else if (ray.collision_side == 1) {
-        ray.perp_wall_dist = (side_dist_y - delta_dist_y);
-        ray.max_perp_wall_dist = (kMaxRayDist - delta_dist_y);
+    alignas(16) float side_dist_x[4], side_dist_y[4], side_dist_z[4];
+    alignas(16) int sides[4], steps[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(pos_x), pos[0]);
+    _mm_store_si128(reinterpret_cast<__m128i *>(pos_y), pos[1]);
+    _mm_store_si128(reinterpret_cast<__m128i *>(pos_z), pos[2]);
+    _mm_store_ps(side_dist_x, side_dist[0]);
+    _mm_store_ps(side_dist_y, side_dist[1]);
+    _mm_store_ps(side_dist_z, side_dist[2]);
+    _mm_store_si128(reinterpret_cast<__m128i *>(sides), side);
+    _mm_store_si128(reinterpret_cast<__m128i *>(steps), n_steps);
+    for (int i = 0; 4 > i; i++) {
+        RayDda &dda = ddas[i];
+        dda.pos = glm::ivec3(pos_x[i], pos_y[i], pos_z[i]);
+        dda.side_dist = glm::vec3(side_dist_x[i], side_dist_y[i], side_dist_z[i]);
+        dda.side = sides[i];
+        dda.n_steps = steps[i];
+        if (active >> i & 1) {
+            hits |= TraceRay(rays[i], dda) << i;
+            continue;
+        }
+        if (use_lod && (far >> i & 1)) {
+            hits |= TraceLodRay(rays[i], dda) << i;
+            continue;
+        }
+        Ray &ray = rays[i];
+        if (hits >> i & 1) {
+            ray.block = chunks[i]->blocks[ToChunkIndex(dda.pos.x, dda.pos.y, dda.pos.z)];
+        }
+        ray.pos = dda.pos;
+        ray.collision_side = dda.side;
+        ray.n_steps = dda.n_steps;
+        ray.perp_wall_dist = dda.side_dist[dda.side] - dda.delta_dist[dda.side];
+        ray.max_perp_wall_dist = view_dist_ - dda.delta_dist[dda.side];
     }
-    else {
-        ray.perp_wall_dist = (side_dist_z - delta_dist_z);
-        ray.max_perp_wall_dist = (kMaxRayDist - delta_dist_z);
+    return hits;
+}
+#else
+int Game::CastRayPacket(int x, int y, Ray rays[4]) const {
+    int hits = 0;
+    for (int i = 0; 4 > i; i++) {
+        hits |= CastRay(x + i % 2, y + i / 2, rays[i]) << i;
     }
+    return hits;
+}
+#endif
 
-    return hit;
+void Game::HitSameFace(float x, float y, const Ray &hit, Ray &ray) const {
+    int side = hit.collision_side;
+    ray.dir = CalcRayDir(x, y);
+    ray.pos = hit.pos;
+    ray.collision_side = side;
+    ray.block = hit.block;
+    // 見えている面はBlockのカメラ側の境界
+    float plane = hit.pos[side] + (ray.dir[side] < 0 ? 1 : 0);
+    ray.perp_wall_dist = (plane - pos_[side]) / ray.dir[side];
+    ray.max_perp_wall_dist = view_dist_ - std::abs(1 / ray.dir[side]);
+    ray.n_steps = 0;
 }
 
 uint32_t Game::CalcPixelColor(const Ray &ray) const {
-    char block = GetMapBlock(ray.pos);
+    return ApplyFog(CalcTexColor(ray), ray.perp_wall_dist, ray.max_perp_wall_dist);
+}
+
+uint32_t Game::CalcTexColor(const Ray &ray) const {
+    char block = ray.block;
     float wall_x, wall_y;
     if (ray.collision_side == 0) {
         wall_x = pos_.z + ray.perp_wall_dist * ray.dir.z;
@@ -351,94 +1203,712 @@ uint32_t Game::CalcPixelColor(const Ray &ray) const {
 
     int tex_x = wall_x * kTexWidth;
     int tex_y = wall_y * kTexHeight;
-    int face = 0;
-    if (ray.collision_side == 0) {
-        if (ray.dir.x > 0) {
-            tex_x = kTexWidth - tex_x - 1;
-            face = 0;
-        }
-        else {
-            face = 1;
-        }
+    // x軸とy軸はRayの向きが-のとき、z軸は+のときに奇数番目の面になる
+    int side = ray.collision_side;
+    int face = side * 2;
+    if ((ray.dir[side] > 0) == (side == 2)) {
+        face++;
     }
-    if (ray.collision_side == 1) {
-        if (ray.dir.y > 0) {
-            tex_x = kTexWidth - tex_x - 1;
-            face = 2;
+
+    // 1 pixelが覆うtexelの数(Rayに沿った距離に比例する)が2^level以上なら、
+    // 一辺が1 / 2^levelの段を使う
+    float footprint = pixel_footprint_ * ray.perp_wall_dist * glm::length(ray.dir);
+    int level = 0;
+    while (footprint >= 2.0 && kNTexLevels - 1 > level) {
+        footprint *= 0.5;
+        level++;
+    }
+    return ApplyLight(GetFaceTexColor(block, face, level, tex_x, tex_y), CalcFaceLight(ray));
+}
+
+int Game::CalcFaceLight(const Ray &ray) const {
+    // 当たった点から面の法線に沿って半Block戻ったところ
+    // (粗い格子に当たったRayでも、セルの手前のVoxelになる)
+    int side = ray.collision_side;
+    glm::vec3 front = pos_ + ray.perp_wall_dist * ray.dir;
+    front[side] -= ray.dir[side] > 0 ? 0.5f : -0.5f;
+    uint8_t light = GetMapLight(glm::ivec3(glm::floor(front)));
+    return std::max(light >> kSkyLightShift & kMaxLight, light >> kBlockLightShift & kMaxLight);
+}
+
+uint32_t Game::ApplyLight(uint32_t color, int light) {
+    // R, Bと、Gを別々に掛ける(倍率は256以下なので隣の色にあふれない)
+    uint32_t brightness = kLightBrightness[light];
+    return ((color & 0xFF00FF) * brightness >> 8 & 0xFF00FF)
+        | ((color & 0x00FF00) * brightness >> 8 & 0x00FF00);
+}
+
+uint32_t Game::ApplyFog(uint32_t color, float dist, float max_dist) {
+    uint32_t fog = std::min(0xFFu, (uint32_t)(0xFF * dist / max_dist));
+    return
+        std::min((color >> 16 & 0xFF) + fog, 0xFFu) << 16 |
+        std::min((color >> 8  & 0xFF) + fog, 0xFFu) << 8  |
+        std::min((color       & 0xFF) + fog, 0xFFu);
+}
+
+void Game::RenderTiles(int width, int height, int tile_size,
+    const std::function<void(int, int, int, int, RayCounter &)> &render) {
+    int n_tiles_x = (width + tile_size - 1) / tile_size;
+    int n_tiles_y = (height + tile_size - 1) / tile_size;
+    for (RayCounter &counter : ray_counters_) {
+        counter.n_rays = 0;
+        counter.n_ray_steps = 0;
+        counter.n_hits = 0;
+    }
+    tile_pool_->Run(n_tiles_x * n_tiles_y, [&](int tile, int thread) {
+        int x0 = tile % n_tiles_x * tile_size;
+        int y0 = tile / n_tiles_x * tile_size;
+        render(x0, y0, std::min(x0 + tile_size, width),
+            std::min(y0 + tile_size, height), ray_counters_[thread]);
+    });
+    render_stats_ = tile_pool_->GetStats();
+    n_rays_ = 0;
+    n_ray_steps_ = 0;
+    n_hits_ = 0;
+    for (const RayCounter &counter : ray_counters_) {
+        n_rays_ += counter.n_rays;
+        n_ray_steps_ += counter.n_ray_steps;
+        n_hits_ += counter.n_hits;
+    }
+}
+
+void Game::SimpleRaycasting() {
+    RenderTiles(screen_width_, screen_height_, kTileSize,
+        [this](int x0, int y0, int x1, int y1, RayCounter &counter) {
+        for (int y = y0; y1 > y; y++) {
+            for (int x = x0; x1 > x; x++) {
+                Ray ray;
+                bool hit = CastRay(x, y, ray);
+                counter.n_rays++;
+                counter.n_ray_steps += ray.n_steps;
+                counter.n_hits += hit;
+                if (hit) {
+                    uint32_t color = CalcPixelColor(ray);
+                    SetBufColor(x, screen_height_ - y - 1, color);
+                }
+                else {
+                    SetBufColor(x, screen_height_ - y - 1, 0xFFFFFF);
+                }
+            }
         }
-        else {
-            face = 3;
+    });
+}
+
+void Game::SlackOffRaycasting() {
+    StrideRaycasting(3);
+}
+
+void Game::StrideRaycasting(int stride) {
+    // Tileの左上がstrideの倍数なので、マスの中心は全体で見たときと同じ位置になる
+    int tile_size = (kTileSize + stride - 1) / stride * stride;
+    RenderTiles(screen_width_, screen_height_, tile_size,
+        [this, stride](int x0, int y0, int x1, int y1, RayCounter &counter) {
+        for (int y = y0; y1 > y; y += stride) {
+            for (int x = x0; x1 > x; x += stride) {
+                // 画面の端で欠けたマスは、中心の代わりに端のpixelにRayを飛ばす
+                Ray ray;
+                bool hit = CastRay(std::min(x + stride / 2, x1 - 1),
+                    std::min(y + stride / 2, y1 - 1), ray);
+                counter.n_rays++;
+                counter.n_ray_steps += ray.n_steps;
+                counter.n_hits += hit;
+                uint32_t color = hit ? CalcPixelColor(ray) : 0xFFFFFF;
+                for (int py = y; std::min(y + stride, y1) > py; py++) {
+                    for (int px = x; std::min(x + stride, x1) > px; px++) {
+                        SetBufColor(px, screen_height_ - py - 1, color);
+                    }
+                }
+            }
         }
+    });
+}
+
+namespace {
+    // aとbの色をt / 256 : (256 - t) / 256で混ぜる
+    // R, Bを1回の掛け算でまとめて計算する
+    inline uint32_t LerpColor(uint32_t a, uint32_t b, uint32_t t) {
+        uint32_t rb = ((a & 0xFF00FF) * (256 - t) + (b & 0xFF00FF) * t) >> 8;
+        uint32_t g = ((a & 0xFF00) * (256 - t) + (b & 0xFF00) * t) >> 8;
+        return (rb & 0xFF00FF) | (g & 0xFF00);
     }
-    if (ray.collision_side == 2) {
-        if (ray.dir.z < 0) {
-            tex_x = kTexWidth - tex_x - 1;
-            face = 4;
+}
+
+void Game::UpscaleRaycasting(float scale) {
+    scaled_width_ = std::max(1, (int)std::ceil(screen_width_ * scale));
+    scaled_height_ = std::max(1, (int)std::ceil(screen_height_ * scale));
+    scaled_buffer_.resize(scaled_width_ * scaled_height_);
+    // 切り上げた分を含めた実際の倍率
+    float scale_x = (float)scaled_width_ / screen_width_;
+    float scale_y = (float)scaled_height_ / screen_height_;
+
+    // 縮小した画のpixel(i, j)の中心は、画面上の((i + 0.5) / scale - 0.5, ...)
+    RenderTiles(scaled_width_, scaled_height_, kTileSize,
+        [this, scale_x, scale_y](int x0, int y0, int x1, int y1, RayCounter &counter) {
+        for (int y = y0; y1 > y; y++) {
+            for (int x = x0; x1 > x; x++) {
+                Ray ray;
+                bool hit = CastRay((x + 0.5) / scale_x - 0.5, (y + 0.5) / scale_y - 0.5, ray);
+                counter.n_rays++;
+                counter.n_ray_steps += ray.n_steps;
+                counter.n_hits += hit;
+                scaled_buffer_[scaled_width_ * y + x] = hit ? CalcPixelColor(ray) : 0xFFFFFF;
+            }
         }
-        else {
-            face = 5;
+    });
+
+    // 画面のpixelの中心に対応する位置を、左上のpixelと重み(/256)に分けておく
+    auto to_source = [](int x, float scale, int size, int &x0, uint32_t &t) {
+        float u = std::max((x + 0.5f) * scale - 0.5f, 0.0f);
+        x0 = std::min((int)u, size - 1);
+        t = x0 + 1 < size ? (uint32_t)((u - x0) * 256.0f) : 0;
+    };
+    std::vector<int> src_x(screen_width_);
+    std::vector<uint32_t> weight_x(screen_width_);
+    for (int x = 0; screen_width_ > x; x++) {
+        to_source(x, scale_x, scaled_width_, src_x[x], weight_x[x]);
+    }
+
+    // 拡大はRayを飛ばさないので、ray_counters_やrender_stats_には含めない
+    Profiler::Scope scope(profiler_, Profiler::kUpscale);
+    int n_bands = (screen_height_ + kTileSize - 1) / kTileSize;
+    tile_pool_->Run(n_bands, [&](int band, int) {
+        int y1 = std::min((band + 1) * kTileSize, screen_height_);
+        for (int y = band * kTileSize; y1 > y; y++) {
+            int sy;
+            uint32_t ty;
+            to_source(y, scale_y, scaled_height_, sy, ty);
+            const uint32_t *row0 = &scaled_buffer_[scaled_width_ * sy];
+            const uint32_t *row1 = ty > 0 ? row0 + scaled_width_ : row0;
+            uint32_t *dst = &buffer_[screen_width_ * (screen_height_ - y - 1)];
+            for (int x = 0; screen_width_ > x; x++) {
+                int sx = src_x[x];
+                int sx1 = weight_x[x] > 0 ? sx + 1 : sx;
+                uint32_t top = LerpColor(row0[sx], row0[sx1], weight_x[x]);
+                uint32_t bottom = LerpColor(row1[sx], row1[sx1], weight_x[x]);
+                dst[x] = LerpColor(top, bottom, ty);
+            }
         }
+    });
+}
+
+void Game::ScaledRaycasting(float scale) {
+    if (scale >= 1.0) {
+        PacketRaycasting();
+        return;
+    }
+    // 1 / nに近ければ、拡大の処理がいらないStrideRaycastingで描く
+    int stride = (int)std::round(1.0 / scale);
+    if (std::abs(1.0 / stride - scale) < 1e-3) {
+        StrideRaycasting(stride);
     }
+    else {
+        UpscaleRaycasting(scale);
+    }
+}
 
-    int tex = GetTex(block, face);
-    uint32_t color = GetTexColor(tex, tex_x, kTexHeight - tex_y - 1);
-    if (ray.collision_side == 1 || ray.collision_side == 2) {
-        color = (color >> 1) & 0x7F7F7F;
+void Game::AdaptiveRaycasting() {
+    if (locked_render_scale_ > 0.0) {
+        ScaledRaycasting(locked_render_scale_);
+        return;
+    }
+    // 止まっている間は前のフレームを再利用して、縮小せずに描く
+    // 見回しているだけのときも再利用するが、前のフレームで飛ばし直したRayが
+    // 縮小して描くときのRayより多ければ(速く見回している)、縮小して描く
+    // 再利用したフレームの時間は倍率を選ぶのに使わない
+    bool same_view = dir_ == last_render_dir_ && plane_x_ == last_render_plane_x_ &&
+        plane_y_ == last_render_plane_y_;
+    float scale = kRenderScales[render_scale_level_];
+    bool reproject = pos_ == last_render_pos_ &&
+        (same_view || (reprojected_last_frame_ && !reproject_costly_));
+    if (!reproject && !reprojected_last_frame_) {
+        UpdateRenderScale();
+    }
+    last_render_pos_ = pos_;
+    last_render_dir_ = dir_;
+    last_render_plane_x_ = plane_x_;
+    last_render_plane_y_ = plane_y_;
+    reprojected_last_frame_ = reproject;
+    if (reproject) {
+        ReprojectRaycasting();
+        // 再利用できなかったpixelだけRayを飛ばし直す
+        long long n_pixels = (long long)screen_width_ * screen_height_;
+        profiler_.Count(Profiler::kCacheLookups, n_pixels);
+        profiler_.Count(Profiler::kCacheMisses, n_rays_);
+        // 止まっているフレームは描き直すRayが少ないので、見回したフレームで測る
+        reproject_costly_ = !same_view && n_rays_ > scale * scale * n_pixels;
+    }
+    else {
+        render_cache_valid_ = false;
+        ScaledRaycasting(kRenderScales[render_scale_level_]);
     }
-    uint32_t fog = std::min(0xFFu,
-        (uint32_t)(0xFF * ray.perp_wall_dist / ray.max_perp_wall_dist));
-    color =
-        std::min((color >> 16 & 0xFF) + fog, 0xFFu) << 16 |
-        std::min((color >> 8  & 0xFF) + fog, 0xFFu) << 8  |
-        std::min((color       & 0xFF) + fog, 0xFFu);
-    return color;
 }
 
-void Game::SimpleRaycasting() {
-#pragma omp parallel for num_threads(4)
-    for (int y = 0; screen_height_ > y; y++) {
-        for (int x = 0; screen_width_ > x; x++) {
-            Ray ray;
-            bool hit = CastRay(x, y, ray);
-            if (hit) {
-                uint32_t color = CalcPixelColor(ray);
-                SetBufColor(x, screen_height_ - y - 1, color);
+void Game::UpdateRenderScale() {
+    // render_frame_time_は前のフレームの時間(画面への転送なども含む)
+    if (smoothed_frame_time_ == 0.0) {
+        smoothed_frame_time_ = render_frame_time_;
+    }
+    else {
+        smoothed_frame_time_ = smoothed_frame_time_ * 0.9 + render_frame_time_ * 0.1;
+    }
+    if (render_scale_cooldown_ > 0) {
+        render_scale_cooldown_--;
+        return;
+    }
+
+    int level = render_scale_level_;
+    if (smoothed_frame_time_ > kTargetFrameTime * 1.05) {
+        level = std::min(level + 1, kNRenderScales - 1);
+    }
+    else if (level > 0) {
+        // Rayの数は倍率の2乗に比例するので、上げた後のフレーム時間を見積もって
+        // 目標に余裕を持って収まるときだけ上げる(上げ下げを繰り返さないように)
+        float ratio = kRenderScales[level - 1] / kRenderScales[level];
+        if (smoothed_frame_time_ * ratio * ratio < kTargetFrameTime * 0.9) {
+            level--;
+        }
+    }
+    if (level != render_scale_level_) {
+        render_scale_level_ = level;
+        render_scale_cooldown_ = kRenderScaleCooldown;
+        // 新しい倍率のフレーム時間から測り直す
+        smoothed_frame_time_ = 0.0;
+    }
+}
+
+void Game::PacketRaycasting() {
+    gbuffer_colors_.resize(screen_width_ * screen_height_);
+    gbuffer_dists_.resize(screen_width_ * screen_height_);
+    gbuffer_max_dists_.resize(screen_width_ * screen_height_);
+    RenderTiles(screen_width_, screen_height_, kTileSize,
+        [this](int x0, int y0, int x1, int y1, RayCounter &counter) {
+        // 色を付けるときにはTileのG-bufferがまだキャッシュに残っている
+        TraceGBufferTile(x0, y0, x1, y1, counter);
+        ShadeGBufferTile(x0, y0, x1, y1);
+    });
+}
+
+void Game::TraceGBufferTile(int x0, int y0, int x1, int y1, RayCounter &counter) {
+    for (int y = y0; y1 > y; y += 2) {
+        for (int x = x0; x1 > x; x += 2) {
+            Ray rays[4];
+            int hits;
+            if (x1 > x + 1 && y1 > y + 1) {
+                hits = CastRayPacket(x, y, rays);
             }
             else {
-                SetBufColor(x, screen_height_ - y - 1, 0xFFFFFF);
+                // 画面の端で2x2に満たないところは1本ずつ
+                hits = 0;
+                for (int i = 0; 4 > i; i++) {
+                    if (x1 > x + i % 2 && y1 > y + i / 2) {
+                        hits |= CastRay(x + i % 2, y + i / 2, rays[i]) << i;
+                    }
+                    else {
+                        rays[i].n_steps = -1;
+                    }
+                }
+            }
+            for (int i = 0; 4 > i; i++) {
+                if (rays[i].n_steps < 0) {
+                    continue;
+                }
+                counter.n_rays++;
+                counter.n_ray_steps += rays[i].n_steps;
+                counter.n_hits += hits >> i & 1;
+                int index = screen_width_ * (screen_height_ - y - i / 2 - 1) + x + i % 2;
+                if (hits >> i & 1) {
+                    gbuffer_colors_[index] = CalcTexColor(rays[i]);
+                    gbuffer_dists_[index] = rays[i].perp_wall_dist;
+                    gbuffer_max_dists_[index] = rays[i].max_perp_wall_dist;
+                }
+                else {
+                    gbuffer_colors_[index] = 0xFFFFFF;
+                    gbuffer_dists_[index] = 0.0;
+                    gbuffer_max_dists_[index] = 1.0;
+                }
             }
         }
     }
 }
 
-void Game::SlackOffRaycasting() {
-#pragma omp parallel for num_threads(4)
-    for (int y = 1; screen_height_ - 1 > y; y += 3) {
-        for (int x = 1; screen_width_ - 1 > x; x += 3) {
-            Ray ray;
-            bool hit = CastRay(x, y, ray);
-            if (hit) {
-                uint32_t color = CalcPixelColor(ray);
-                for (int dy = -1; 1 >= dy; dy++) {
-                    for (int dx = -1; 1 >= dx; dx++) {
-                        SetBufColor(x + dx, screen_height_ - y - dy - 1, color);
+void Game::ShadeGBufferTile(int x0, int y0, int x1, int y1) {
+    for (int y = screen_height_ - y1; screen_height_ - y0 > y; y++) {
+        int row = screen_width_ * y;
+        int x = x0;
+#ifdef __SSE2__
+        // 4 pixelずつ、霧の濃さを求めて各チャンネルに飽和加算する
+        const __m128 kMaxFog = _mm_set1_ps(0xFF);
+        const __m128i kRgbMask = _mm_set1_epi32(0xFFFFFF);
+        for (; x1 >= x + 4; x += 4) {
+            __m128 dist = _mm_loadu_ps(&gbuffer_dists_[row + x]);
+            __m128 max_dist = _mm_loadu_ps(&gbuffer_max_dists_[row + x]);
+            __m128i fog = _mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(kMaxFog, dist), max_dist));
+            // 0 ~ 255に飽和させて、各pixelの霧の濃さを4byteに複製する
+            fog = _mm_packs_epi32(fog, fog);
+            fog = _mm_packus_epi16(fog, fog);
+            fog = _mm_unpacklo_epi8(fog, fog);
+            fog = _mm_unpacklo_epi16(fog, fog);
+            __m128i color = _mm_loadu_si128((const __m128i *)&gbuffer_colors_[row + x]);
+            color = _mm_and_si128(_mm_adds_epu8(color, fog), kRgbMask);
+            _mm_storeu_si128((__m128i *)&buffer_[row + x], color);
+        }
+#endif
+        for (; x1 > x; x++) {
+            buffer_[row + x] = ApplyFog(gbuffer_colors_[row + x],
+                gbuffer_dists_[row + x], gbuffer_max_dists_[row + x]);
+        }
+    }
+}
+
+void Game::EdgeAwareRaycasting(bool fill_cache) {
+    if (fill_cache) {
+        render_cache_.resize(screen_width_ * screen_height_);
+    }
+    RenderTiles(screen_width_, screen_height_, kEdgeAwareTileSize,
+        [this, fill_cache](int x0, int y0, int x1, int y1, RayCounter &counter) {
+        constexpr int kStride = kEdgeAwareStride;
+        constexpr int kMaxN = kEdgeAwareTileSize / kEdgeAwareStride + 1;
+        // 格子点(右端と下端は隣のTileの最初の格子点と同じ位置に飛ばす)
+        int n_x = (x1 - x0 + kStride - 1) / kStride + 1;
+        int n_y = (y1 - y0 + kStride - 1) / kStride + 1;
+        int grid_x[kMaxN], grid_y[kMaxN];
+        for (int i = 0; n_x > i; i++) {
+            grid_x[i] = std::min(x0 + i * kStride, screen_width_ - 1);
+        }
+        for (int j = 0; n_y > j; j++) {
+            grid_y[j] = std::min(y0 + j * kStride, screen_height_ - 1);
+        }
+        Ray samples[kMaxN][kMaxN];
+        bool hits[kMaxN][kMaxN];
+        for (int j = 0; n_y > j; j++) {
+            for (int i = 0; n_x > i; i++) {
+                hits[j][i] = CastRay(grid_x[i], grid_y[j], samples[j][i]);
+                counter.n_rays++;
+                counter.n_ray_steps += samples[j][i].n_steps;
+                counter.n_hits += hits[j][i];
+            }
+        }
+
+        for (int j = 0; n_y - 1 > j; j++) {
+            for (int i = 0; n_x - 1 > i; i++) {
+                // 四隅が全て空か、全て同じBlockの同じ面に当たっていれば、
+                // その間のpixelも同じ面に当たるとみなす
+                const Ray &corner = samples[j][i];
+                bool uniform_hit = hits[j][i];
+                bool uniform = true;
+                for (int k = 1; 4 > k; k++) {
+                    const Ray &other = samples[j + k / 2][i + k % 2];
+                    if (hits[j + k / 2][i + k % 2] != uniform_hit || (uniform_hit &&
+                        (other.pos != corner.pos || other.collision_side != corner.collision_side))) {
+                        uniform = false;
+                        break;
+                    }
+                }
+
+                int cell_x1 = std::min(x0 + (i + 1) * kStride, x1);
+                int cell_y1 = std::min(y0 + (j + 1) * kStride, y1);
+                for (int y = y0 + j * kStride; cell_y1 > y; y++) {
+                    for (int x = x0 + i * kStride; cell_x1 > x; x++) {
+                        Ray ray;
+                        bool hit;
+                        int si = x == grid_x[i] ? i : x == grid_x[i + 1] ? i + 1 : -1;
+                        int sj = y == grid_y[j] ? j : y == grid_y[j + 1] ? j + 1 : -1;
+                        if (si >= 0 && sj >= 0) {
+                            ray = samples[sj][si];
+                            hit = hits[sj][si];
+                        }
+                        else if (uniform) {
+                            hit = uniform_hit;
+                            if (hit) {
+                                HitSameFace(x, y, corner, ray);
+                            }
+                        }
+                        else {
+                            hit = CastRay(x, y, ray);
+                            counter.n_rays++;
+                            counter.n_ray_steps += ray.n_steps;
+                            counter.n_hits += hit;
+                        }
+                        uint32_t color = hit ? CalcPixelColor(ray) : 0xFFFFFF;
+                        SetBufColor(x, screen_height_ - y - 1, color);
+                        if (fill_cache) {
+                            render_cache_[screen_width_ * y + x] = hit
+                                ? CachedPixel{ ray.pos, color, (int8_t)ray.collision_side, ray.block }
+                                : CachedPixel{ glm::ivec3(0), color, kCacheMiss, kAirBlock };
+                        }
                     }
                 }
             }
-            else {
-                for (int dy = -1; 1 >= dy; dy++) {
-                    for (int dx = -1; 1 >= dx; dx++) {
-                        SetBufColor(x + dx, screen_height_ - y - dy - 1, 0xFFFFFF);
+        }
+    });
+    if (fill_cache) {
+        render_cache_valid_ = true;
+        cache_pos_ = pos_;
+        cache_dir_ = dir_;
+        cache_plane_x_ = plane_x_;
+        cache_plane_y_ = plane_y_;
+    }
+}
+
+bool Game::ToCacheScreen(const glm::vec3 &v, float &x, float &y) const {
+    // InitRayの逆(dir_, plane_x_, plane_y_は互いに直交している)
+    float s = glm::dot(v, cache_dir_) / glm::dot(cache_dir_, cache_dir_);
+    if (s <= 0.0) {
+        return false;
+    }
+    float camera_x = glm::dot(v, cache_plane_x_) /
+        glm::dot(cache_plane_x_, cache_plane_x_) / s;
+    float camera_y = glm::dot(v, cache_plane_y_) /
+        glm::dot(cache_plane_y_, cache_plane_y_) / s;
+    x = (camera_x + 1) * screen_width_ / 2;
+    y = (camera_y + 1) * screen_height_ / 2;
+    return true;
+}
+
+inline const Game::CachedPixel *Game::FindCachedFace(float x, float y) const {
+    if (!(x >= 0.0 && y >= 0.0)) {
+        return nullptr;
+    }
+    int x0 = x, y0 = y;
+    int x1 = x > x0 ? x0 + 1 : x0;
+    int y1 = y > y0 ? y0 + 1 : y0;
+    if (x1 >= screen_width_ || y1 >= screen_height_) {
+        return nullptr;
+    }
+
+    // EdgeAwareRaycastingと同じく、周りの4 pixelが同じ面に当たっていれば間も同じとみなす
+    const CachedPixel &pixel = render_cache_[screen_width_ * y0 + x0];
+    if (pixel.side == kCacheInvalid) {
+        return nullptr;
+    }
+    const CachedPixel *others[3] = {
+        &render_cache_[screen_width_ * y0 + x1],
+        &render_cache_[screen_width_ * y1 + x0],
+        &render_cache_[screen_width_ * y1 + x1],
+    };
+    for (const CachedPixel *other : others) {
+        if (other->side != pixel.side ||
+            (pixel.side != kCacheMiss && other->pos != pixel.pos)) {
+            return nullptr;
+        }
+    }
+    return &pixel;
+}
+
+void Game::ReprojectRaycasting() {
+    if (!render_cache_valid_ || pos_ != cache_pos_) {
+        EdgeAwareRaycasting(true);
+        return;
+    }
+
+    // 向きも変わっていなければ、捨てられていないpixelはその場でそのまま使う
+    bool same_view = dir_ == cache_dir_ && plane_x_ == cache_plane_x_ &&
+        plane_y_ == cache_plane_y_;
+    std::vector<CachedPixel> &out = same_view ? render_cache_ : next_render_cache_;
+    out.resize(screen_width_ * screen_height_);
+    RenderTiles(screen_width_, screen_height_, kTileSize,
+        [this, same_view, &out](int x0, int y0, int x1, int y1, RayCounter &counter) {
+        // 新しいRayの向きはxについて線形なので、render_cache_のカメラで見た座標
+        // (ToCacheScreenの分子と分母)も1 pixelごとに足していけば求まる
+        glm::vec3 cache_dir = cache_dir_ / glm::dot(cache_dir_, cache_dir_);
+        glm::vec3 cache_plane_x = cache_plane_x_ / glm::dot(cache_plane_x_, cache_plane_x_);
+        glm::vec3 cache_plane_y = cache_plane_y_ / glm::dot(cache_plane_y_, cache_plane_y_);
+        glm::vec3 delta_dir = plane_x_ * (2.0f / screen_width_);
+        glm::vec3 delta(glm::dot(delta_dir, cache_dir),
+            glm::dot(delta_dir, cache_plane_x), glm::dot(delta_dir, cache_plane_y));
+        for (int y = y0; y1 > y; y++) {
+            glm::vec3 dir = CalcRayDir(x0, y);
+            glm::vec3 projected(glm::dot(dir, cache_dir),
+                glm::dot(dir, cache_plane_x), glm::dot(dir, cache_plane_y));
+            for (int x = x0; x1 > x; x++, projected += delta) {
+                CachedPixel &pixel = out[screen_width_ * y + x];
+                const CachedPixel *face = nullptr;
+                if (same_view) {
+                    if (pixel.side != kCacheInvalid) {
+                        SetBufColor(x, screen_height_ - y - 1, pixel.color);
+                        continue;
                     }
                 }
+                else if (projected.x > 0.0) {
+                    face = FindCachedFace((projected.y / projected.x + 1) * screen_width_ / 2,
+                        (projected.z / projected.x + 1) * screen_height_ / 2);
+                }
+
+                Ray ray;
+                bool hit;
+                if (face) {
+                    hit = face->side != kCacheMiss;
+                    if (hit) {
+                        Ray face_ray;
+                        face_ray.pos = face->pos;
+                        face_ray.collision_side = face->side;
+                        face_ray.block = face->block;
+                        HitSameFace(x, y, face_ray, ray);
+                    }
+                }
+                else {
+                    hit = CastRay(x, y, ray);
+                    counter.n_rays++;
+                    counter.n_ray_steps += ray.n_steps;
+                    counter.n_hits += hit;
+                }
+                uint32_t color = hit ? CalcPixelColor(ray) : 0xFFFFFF;
+                SetBufColor(x, screen_height_ - y - 1, color);
+                pixel = hit
+                    ? CachedPixel{ ray.pos, color, (int8_t)ray.collision_side, ray.block }
+                    : CachedPixel{ glm::ivec3(0), color, kCacheMiss, kAirBlock };
             }
         }
+    });
+    if (!same_view) {
+        render_cache_.swap(next_render_cache_);
+        cache_dir_ = dir_;
+        cache_plane_x_ = plane_x_;
+        cache_plane_y_ = plane_y_;
     }
 }
 
-void Game::HandleKeys() {
-    float move_speed = frame_time_ * 5.0;
+void Game::InvalidateRenderCache(const glm::ivec3 &box_min, const glm::ivec3 &box_max) {
+    if (!render_cache_valid_) {
+        return;
+    }
+    // 範囲の8つの頂点を画面に投影し、それを囲む範囲を捨てる
+    // (Blockに当たるRayも、Blockを通り抜けていたRayもこの範囲に入る)
+    // 粗い格子で描いていれば、Blockを含むセルの代表のBlockも変わり得る
+    int size = GetLodEndDist(0) < view_dist_ ? 1 << kNLodLevels : 1;
+    glm::ivec3 origin(box_min.x & -size, box_min.y & -size, box_min.z & -size);
+    glm::ivec3 extent = glm::ivec3(box_max.x & -size, box_max.y & -size, box_max.z & -size)
+        + glm::ivec3(size) - origin;
+    float min_x = screen_width_, max_x = -1.0;
+    float min_y = screen_height_, max_y = -1.0;
+    for (int i = 0; 8 > i; i++) {
+        glm::vec3 v = glm::vec3(origin
+            + extent * glm::ivec3(i & 1, i >> 1 & 1, i >> 2)) - cache_pos_;
+        float x, y;
+        if (!ToCacheScreen(v, x, y)) {
+            // カメラの後ろにかかるBlockは範囲を求められないので全て捨てる
+            render_cache_valid_ = false;
+            return;
+        }
+        min_x = std::min(min_x, x);
+        max_x = std::max(max_x, x);
+        min_y = std::min(min_y, y);
+        max_y = std::max(max_y, y);
+    }
+    int x0 = std::max((int)std::floor(min_x) - 1, 0);
+    int x1 = std::min((int)std::ceil(max_x) + 2, screen_width_);
+    int y0 = std::max((int)std::floor(min_y) - 1, 0);
+    int y1 = std::min((int)std::ceil(max_y) + 2, screen_height_);
+    for (int y = y0; y1 > y; y++) {
+        for (int x = x0; x1 > x; x++) {
+            render_cache_[screen_width_ * y + x].side = kCacheInvalid;
+        }
+    }
+}
 
+void Game::Benchmark(int n_frames) {
+    assert(headless_ && n_frames > 0);
+    Init();
+    // 計測中にChunkが読み込まれないように、読み込みを全て終えてから始める
+    WaitChunkIo();
+    UpdateChunks();
+
+    std::cout << "Map: " << ToMapFileName(0) << ", Screen: "
+        << screen_width_ << "x" << screen_height_
+        << ", Frames: " << n_frames
+        << ", Threads: " << tile_pool_->GetNThreads() << std::endl;
+    BenchRaycasting("SimpleRaycasting", [this] { SimpleRaycasting(); }, n_frames);
+    BenchRaycasting("SlackOffRaycasting", [this] { SlackOffRaycasting(); }, n_frames);
+    BenchRaycasting("PacketRaycasting", [this] { PacketRaycasting(); }, n_frames);
+    // PacketRaycastingのRayを進める処理と色を付ける処理を、それぞれ画面全体で計測する
+    BenchRaycasting("  TraceGBuffer", [this] {
+        RenderTiles(screen_width_, screen_height_, kTileSize,
+            [this](int x0, int y0, int x1, int y1, RayCounter &counter) {
+            TraceGBufferTile(x0, y0, x1, y1, counter);
+        });
+    }, n_frames);
+    BenchRaycasting("  ShadeGBuffer", [this] {
+        RenderTiles(screen_width_, screen_height_, kTileSize,
+            [this](int x0, int y0, int x1, int y1, RayCounter &) {
+            ShadeGBufferTile(x0, y0, x1, y1);
+        });
+    }, n_frames);
+    BenchRaycasting("EdgeAwareRaycasting", [this] { EdgeAwareRaycasting(); }, n_frames);
+    // 止まっているときと、ゆっくり見回しているとき(1フレームに0.5度)
+    render_cache_valid_ = false;
+    BenchRaycasting("Reproject (idle)", [this] {
+        SetBenchCamera(0, 1);
+        ReprojectRaycasting();
+    }, n_frames);
+    int pan_frame = 0;
+    BenchRaycasting("Reproject (pan)", [this, &pan_frame] {
+        SetBenchCamera(pan_frame++, 720);
+        ReprojectRaycasting();
+    }, n_frames);
+    // AdaptiveRaycastingが選ぶ倍率ごとの速さ
+    for (int i = 0; kNRenderScales > i; i++) {
+        std::ostringstream name;
+        name << "ScaledRaycasting x" << std::setprecision(2) << kRenderScales[i];
+        float scale = kRenderScales[i];
+        BenchRaycasting(name.str(), [this, scale] { ScaledRaycasting(scale); }, n_frames);
+    }
+
+    StopChunkIo();
+    tile_pool_.reset();
+    own_buffer_.reset();
+    buffer_ = nullptr;
+}
+
+void Game::SetBenchCamera(int frame, int n_frames) {
+    // 初期位置で一回転しながら、上下にも視点を振る
+    InitPlayer();
+    float yaw = 2.0 * M_PI * frame / n_frames;
+    dir_ = glm::rotateY(dir_, yaw);
+    plane_x_ = glm::rotateY(plane_x_, yaw);
+    plane_y_ = glm::rotateY(plane_y_, yaw);
+    TryRotateY(0.4 * std::sin(2.0 * yaw));
+}
+
+void Game::BenchRaycasting(const std::string &name,
+    const std::function<void()> &raycasting, int n_frames) {
+    // 1フレーム目はキャッシュやスレッドの立ち上げを含むので計測しない
+    SetBenchCamera(0, n_frames);
+    raycasting();
+
+    double total_time = 0.0;
+    long long n_rays = 0, n_ray_steps = 0;
+    // スレッド間の偏り(最も遅いスレッド / 平均)とTileの重さの偏り(最大 / 平均)
+    double thread_imbalance = 0.0, tile_imbalance = 0.0;
+    long long n_steals = 0;
+    for (int frame = 0; n_frames > frame; frame++) {
+        SetBenchCamera(frame, n_frames);
+        auto start = std::chrono::steady_clock::now();
+        raycasting();
+        auto end = std::chrono::steady_clock::now();
+        total_time += std::chrono::duration<double>(end - start).count();
+        n_rays += n_rays_;
+        n_ray_steps += n_ray_steps_;
+        const TilePool::Stats &stats = render_stats_;
+        thread_imbalance += stats.max_thread_ms / stats.mean_thread_ms;
+        tile_imbalance += stats.max_tile_ms / stats.mean_tile_ms;
+        n_steals += stats.n_steals;
+    }
+
+    std::cout << std::left << std::setw(24) << name << std::right
+        << std::fixed << std::setprecision(3)
+        << std::setw(10) << total_time * 1000.0 / n_frames << " ms/frame"
+        << std::setw(10) << n_rays / total_time / 1e6 << " Mrays/s"
+        << std::setw(10) << n_ray_steps / total_time / 1e6 << " Msteps/s"
+        << std::setw(8) << std::setprecision(1)
+        << (n_rays > 0 ? (double)n_ray_steps / n_rays : 0.0) << " steps/ray"
+        << std::setw(8) << std::setprecision(2)
+        << thread_imbalance / n_frames << " thread max/mean"
+        << std::setw(8) << std::setprecision(1)
+        << tile_imbalance / n_frames << " tile max/mean"
+        << std::setw(8) << (double)n_steals / n_frames << " steals/frame" << std::endl;
+}
+
+void Game::HandleKeys() {
     glm::vec3 perdir = glm::normalize(plane_x_);
     glm::vec3 mvdir(0, 0, 0);
     QuickCG::readKeys();
@@ -458,40 +1928,59 @@ void Game::HandleKeys() {
         mvdir.x -= perdir.x;
         mvdir.z -= perdir.z;
     }
-    if (QuickCG::keyDown(SDLK_SPACE)) {
+    if (QuickCG::keyPressed(SDLK_f)) {
+        flying_ = !flying_;
+        velocity_.y = 0.0;
+    }
+    // 歩いているときのSpaceはジャンプ、飛んでいるときは上昇
+    jump_input_ = QuickCG::keyDown(SDLK_SPACE);
+    if (flying_ && QuickCG::keyDown(SDLK_SPACE)) {
         mvdir.y += 1;
     }
-    if (QuickCG::keyDown(SDLK_LSHIFT)) {
+    if (flying_ && QuickCG::keyDown(SDLK_LSHIFT)) {
         mvdir.y -= 1;
     }
-    if (glm::length(mvdir) > 0) {
-        mvdir = move_speed * glm::normalize(mvdir);
-        TryMoveX(mvdir.x);
-        TryMoveY(mvdir.y);
-        TryMoveZ(mvdir.z);
-    }
+    // 速さは物理のstepで掛ける(ここではフレームの時間を使わない)
+    move_input_ = glm::length(mvdir) > 0 ? glm::normalize(mvdir) : glm::vec3(0.0, 0.0, 0.0);
 
     int n_visible_blocks = kNBlocks - 2;
     if (QuickCG::keyPressed(SDLK_RIGHT)) {
         select_block_ = select_block_ % n_visible_blocks + 1;
+        redraw_hud_ = true;
     }
     if (QuickCG::keyPressed(SDLK_LEFT)) {
         select_block_ = (select_block_ - 2 + n_visible_blocks) % n_visible_blocks + 1;
+        redraw_hud_ = true;
+    }
+    if (QuickCG::keyPressed(SDLK_PAGEUP)) {
+        SetViewDist(view_dist_ + kViewDistStep);
+    }
+    if (QuickCG::keyPressed(SDLK_PAGEDOWN)) {
+        SetViewDist(view_dist_ - kViewDistStep);
+    }
+    if (QuickCG::keyPressed(SDLK_F3)) {
+        // 統計を消すときは、上に重ねていた画も描き直す
+        show_profile_ = !show_profile_;
+        redraw_ = true;
     }
 }
 
 void Game::HandleMouseMove(int mouse_x, int mouse_y) {
     float rot_speed = frame_time_ * 0.05;
 
-    SDL_WarpMouse(screen_width_ / 2, screen_height_ / 2);
-    if (mouse_x != screen_width_ / 2) {
-        int delta_x = mouse_x - screen_width_ / 2;
+    // Warpするとイベントが来て入力待ちから起きてしまうので、動いたときだけ戻す
+    if (mouse_x != window_width_ / 2 || mouse_y != window_height_ / 2) {
+        SDL_WarpMouse(window_width_ / 2, window_height_ / 2);
+    }
+    if (mouse_x != window_width_ / 2) {
+        int delta_x = mouse_x - window_width_ / 2;
         dir_ = glm::rotateY(dir_, rot_speed * delta_x);
         plane_x_ = glm::rotateY(plane_x_, rot_speed * delta_x);
         plane_y_ = glm::rotateY(plane_y_, rot_speed * delta_x);
+        redraw_ = true;
     }
-    if (mouse_y != screen_height_ / 2) {
-        int delta_y = mouse_y - screen_height_ / 2;
+    if (mouse_y != window_height_ / 2) {
+        int delta_y = mouse_y - window_height_ / 2;
         float angle = rot_speed * delta_y;
         TryRotateY(angle);
     }
@@ -512,6 +2001,11 @@ void Game::OnRightButtonPress() {
     if (!hit || ray.perp_wall_dist > kPlayerPutBlockDist) {
         return;
     }
+    // TNTは右クリックで火を付ける
+    if (GetMapBlock(ray.pos) == kTntBlock) {
+        IgniteTnt(ray.pos);
+        return;
+    }
     glm::ivec3 block_pos = ray.pos;
     if (ray.collision_side == 0) {
         block_pos.x += ray.dir.x < 0 ? 1 : -1;
@@ -523,24 +2017,29 @@ void Game::OnRightButtonPress() {
         block_pos.z += ray.dir.z < 0 ? 1 : -1;
     }
 
-    assert(GetMapBlock(block_pos) == 0);
+    // Transparent Blockや読み込まれていないChunkには置けない
+    if (GetMapBlock(block_pos) != kAirBlock) {
+        return;
+    }
 
-    SetMapBlock(block_pos, select_block_);
-    hit = HitBlock({
-        glm::ivec3(0, 0, 0), glm::ivec3(0, 0, 1),
-        glm::ivec3(0, 1, 0), glm::ivec3(0, 1, 1),
-        glm::ivec3(0, 2, 0), glm::ivec3(0, 2, 1),
-        glm::ivec3(1, 0, 0), glm::ivec3(1, 0, 1),
-        glm::ivec3(1, 1, 0), glm::ivec3(1, 1, 1),
-        glm::ivec3(1, 2, 0), glm::ivec3(1, 2, 1),
-    });
-    if (hit) {
-        SetMapBlock(block_pos, kAirBlock);
+    // Playerの箱と重なるところには置けない(面で接しているだけなら置ける)
+    glm::vec3 box_min, box_max;
+    GetPlayerBox(player_pos_, box_min, box_max);
+    bool overlap = true;
+    for (int axis = 0; 3 > axis; axis++) {
+        overlap &= box_min[axis] + kCollisionEps < block_pos[axis] + 1 &&
+            block_pos[axis] < box_max[axis] - kCollisionEps;
+    }
+    if (overlap) {
+        return;
     }
+    SetMapBlock(block_pos, select_block_);
 }
 
 void Game::HandleInput() {
+    Profiler::Scope scope(profiler_, Profiler::kInput);
     HandleKeys();
+    UpdateSimulation();
 
     int mouse_x, mouse_y;
     bool lmb, rmb;
@@ -557,84 +2056,345 @@ void Game::HandleInput() {
     prev_rmb_ = rmb;
 }
 
-glm::ivec3 Game::GetPlayerPartPos(const glm::ivec3 &part) const {
-    assert(0 <= part.x && part.x <= 1 && 0 <= part.y && part.y <= 2 &&
-        0 <= part.z && part.z <= 1);
-    glm::ivec3 part_pos;
+void Game::TryRotateY(float angle) {
+    // 視点が逆立ち -> plane_y.yが-
+    glm::vec3 new_plane_y = glm::rotate(plane_y_, angle, plane_x_);
+    if (new_plane_y.y > 0) {
+        dir_ = glm::rotate(dir_, angle, plane_x_);
+        plane_y_ = new_plane_y;
+        redraw_ = true;
+    }
+}
 
-    part_pos.x = pos_.x + (part.x == 0 ? -kPlayerHalfWidth : kPlayerHalfWidth);
-    if (part.y == 0) {
-        part_pos.y = pos_.y - kPlayerLowerHalfHeight;
+void Game::UpdateSimulation() {
+    unsigned long ticks = QuickCG::getTicks();
+    physics_time_ += (ticks - physics_ticks_) / 1000.0;
+    physics_ticks_ = ticks;
+    physics_time_ = std::min(physics_time_, kMaxPhysicsSteps * kPhysicsTimeStep);
+    while (physics_time_ >= kPhysicsTimeStep) {
+        {
+            Profiler::Scope scope(profiler_, Profiler::kPhysics);
+            StepPhysics(kPhysicsTimeStep);
+        }
+        if (++tick_steps_ == kStepsPerTick) {
+            tick_steps_ = 0;
+            Profiler::Scope scope(profiler_, Profiler::kTick);
+            profiler_.Count(Profiler::kBlockTicks, TickBlocks());
+            profiler_.Count(Profiler::kExplosions, ProcessExplosions());
+        }
+        physics_time_ -= kPhysicsTimeStep;
     }
-    else if (part.y == 1) {
-        part_pos.y = pos_.y - kPlayerLowerHalfHeight + 1.0;
+
+    // 描く位置は最後の2 stepの間を、余った時間の分だけ進めたところ
+    float alpha = physics_time_ / kPhysicsTimeStep;
+    glm::vec3 pos = glm::mix(prev_player_pos_, player_pos_, alpha);
+    if (pos != pos_) {
+        pos_ = pos;
+        redraw_ = true;
+    }
+}
+
+void Game::StepPhysics(float dt) {
+    prev_player_pos_ = player_pos_;
+    velocity_.x = move_input_.x * kWalkSpeed;
+    velocity_.z = move_input_.z * kWalkSpeed;
+    if (flying_) {
+        velocity_.y = move_input_.y * kWalkSpeed;
     }
-    else if (part.y == 2) {
-        part_pos.y = pos_.y + kPlayerUpperHalfHeight;
+    else {
+        if (jump_input_ && on_ground_) {
+            velocity_.y = kJumpSpeed;
+        }
+        velocity_.y = std::max(velocity_.y - kGravity * dt, -kMaxFallSpeed);
     }
-    part_pos.z = pos_.z + (part.z == 0 ? -kPlayerHalfDepth : kPlayerHalfDepth);
+    MovePlayer(velocity_ * dt);
+}
 
-    return part_pos;
+void Game::GetPlayerBox(const glm::vec3 &pos, glm::vec3 &box_min, glm::vec3 &box_max) {
+    box_min = glm::vec3(pos.x - kPlayerHalfWidth, pos.y - kPlayerLowerHalfHeight,
+        pos.z - kPlayerHalfDepth);
+    box_max = glm::vec3(pos.x + kPlayerHalfWidth, pos.y + kPlayerUpperHalfHeight,
+        pos.z + kPlayerHalfDepth);
 }
 
-bool Game::HitBlock(const std::vector<glm::ivec3> &parts) const {
-    bool hit = false;
-    for (const glm::ivec3 &part : parts) {
-        hit |= GetMapBlock(GetPlayerPartPos(part)) != kAirBlock;
+bool Game::SweepBox(const glm::vec3 &box_min, const glm::vec3 &box_max, int axis,
+    float &move) const {
+    if (move == 0.0) {
+        return false;
     }
-    return hit;
+    // 残りの2軸で箱が重なっているBlockの範囲(面で接しているだけのBlockは含めない)
+    int u = (axis + 1) % 3, v = (axis + 2) % 3;
+    int u_begin = std::floor(box_min[u] + kCollisionEps);
+    int u_end = std::floor(box_max[u] - kCollisionEps);
+    int v_begin = std::floor(box_min[v] + kCollisionEps);
+    int v_end = std::floor(box_max[v] - kCollisionEps);
+
+    // 先頭の面が新しく入るBlockの層を、近い順に調べる
+    int step = move > 0 ? 1 : -1;
+    float front = move > 0 ? box_max[axis] : box_min[axis];
+    int first = move > 0 ? std::floor(front - kCollisionEps) + 1 : std::floor(front + kCollisionEps) - 1;
+    int last = move > 0 ? std::floor(front + move - kCollisionEps) : std::floor(front + move + kCollisionEps);
+    for (int layer = first; (last - layer) * step >= 0; layer += step) {
+        glm::ivec3 map_pos;
+        map_pos[axis] = layer;
+        for (map_pos[u] = u_begin; u_end >= map_pos[u]; map_pos[u]++) {
+            for (map_pos[v] = v_begin; v_end >= map_pos[v]; map_pos[v]++) {
+                if (GetMapBlock(map_pos) == kAirBlock) {
+                    continue;
+                }
+                // 当たったBlockの面の手前で止める(少しめり込んでいても押し戻さない)
+                float bound = move > 0 ? layer : layer + 1;
+                move = move > 0 ? std::max(0.0f, bound - front) : std::min(0.0f, bound - front);
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
-void Game::TryRotateY(float angle) {
-    // 視点が逆立ち -> plane_y.yが-
-    glm::vec3 new_plane_y = glm::rotate(plane_y_, angle, plane_x_);
-    if (new_plane_y.y > 0) {
-        dir_ = glm::rotate(dir_, angle, plane_x_);
-        plane_y_ = new_plane_y;
+void Game::MovePlayer(const glm::vec3 &move) {
+    // 先に縦に動かし、着地してから横に動かす(段差の角に引っかからないように)
+    static constexpr const int kAxes[3] = { 1, 0, 2 };
+    on_ground_ = false;
+    for (int axis : kAxes) {
+        glm::vec3 box_min, box_max;
+        GetPlayerBox(player_pos_, box_min, box_max);
+        float axis_move = move[axis];
+        if (SweepBox(box_min, box_max, axis, axis_move)) {
+            velocity_[axis] = 0.0;
+            on_ground_ |= axis == 1 && move[axis] < 0;
+        }
+        player_pos_[axis] += axis_move;
     }
 }
 
-void Game::TryMoveX(float mvx) {
-    pos_.x += mvx;
-    int part_x = mvx < 0 ? 0 : 1;
-    bool hit = HitBlock({
-        glm::ivec3(part_x, 0, 0), glm::ivec3(part_x, 0, 1),
-        glm::ivec3(part_x, 1, 0), glm::ivec3(part_x, 1, 1),
-        glm::ivec3(part_x, 2, 0), glm::ivec3(part_x, 2, 1),
-    });
-    if (hit) {
-        pos_.x -= mvx;
+int Game::TickBlocks() {
+    tick_++;
+    int n_ticks = 0;
+    // 予約した時刻が来たBlock
+    while (!scheduled_ticks_.empty() && scheduled_ticks_.front().tick <= tick_) {
+        std::pop_heap(scheduled_ticks_.begin(), scheduled_ticks_.end());
+        ScheduledTick scheduled = scheduled_ticks_.back();
+        scheduled_ticks_.pop_back();
+        scheduled_tick_keys_.erase(ToBlockKey(scheduled.pos));
+        // 置き換わったBlockや、解放されたChunk(TransparentBlockになる)の予定は捨てる
+        if (GetMapBlock(scheduled.pos) == scheduled.block) {
+            OnScheduledTick(scheduled.pos, scheduled.block);
+            n_ticks++;
+        }
     }
+
+    // Random tick: Chunkから選んだ位置がRandom tickを受けるBlockなら処理する
+    // random_tick_blocksの外を選んだら何もしないので、各Blockが選ばれる確率は
+    // Chunk全体から選ぶ場合と同じで、調べるのはRandom tickを受けるBlockがあるChunkだけ
+    tick_chunks_.assign(random_tick_chunks_.begin(), random_tick_chunks_.end());
+    std::sort(tick_chunks_.begin(), tick_chunks_.end());
+    for (long long key : tick_chunks_) {
+        auto it = chunks_.find(key);
+        if (it == chunks_.end() || !it->second) {
+            continue;
+        }
+        // OnRandomTickはBlockを書き換えるだけで、Chunkを解放しない
+        const Chunk &chunk = *it->second;
+        glm::ivec3 origin = FromChunkKey(key) * kChunkSize;
+        for (int i = 0; kRandomTicksPerChunk > i; i++) {
+            // 前のtickで葉が消えるとrandom_tick_blocksは縮むので、毎回比べる
+            unsigned sample = tick_rng_() % kChunkVolume;
+            if (sample >= chunk.random_tick_blocks.size()) {
+                continue;
+            }
+            int index = chunk.random_tick_blocks[sample];
+            glm::ivec3 map_pos = origin + glm::ivec3(index >> kChunkShift & kChunkMask,
+                index >> (2 * kChunkShift), index & kChunkMask);
+            OnRandomTick(map_pos, chunk.blocks[index]);
+            n_ticks++;
+        }
+    }
+    return n_ticks;
 }
 
-void Game::TryMoveY(float mvy) {
-    pos_.y += mvy;
-    int part_y = mvy < 0 ? 0 : 2;
-    bool hit = HitBlock({
-        glm::ivec3(0, part_y, 0), glm::ivec3(0, part_y, 1),
-        glm::ivec3(1, part_y, 0), glm::ivec3(1, part_y, 1),
-    });
-    if (hit) {
-        pos_.y -= mvy;
+void Game::ScheduleBlockTick(const glm::ivec3 &map_pos, int delay) {
+    assert(delay > 0);
+    if (!scheduled_tick_keys_.insert(ToBlockKey(map_pos)).second) {
+        return;
+    }
+    scheduled_ticks_.push_back({ tick_ + delay, n_scheduled_ticks_++, map_pos,
+        GetMapBlock(map_pos) });
+    std::push_heap(scheduled_ticks_.begin(), scheduled_ticks_.end());
+}
+
+void Game::OnScheduledTick(const glm::ivec3 &map_pos, char block) {
+    if (block == kTntBlock) {
+        // 導火線が燃え尽きた(消しておき、もう一度火が付かないようにする)
+        SetMapBlock(map_pos, kAirBlock);
+        pending_explosions_.push_back({ map_pos, (uint32_t)tick_rng_() });
+    }
+}
+
+void Game::OnRandomTick(const glm::ivec3 &map_pos, char block) {
+    if (block == kCherryLeavesBlock && !IsLeafSupported(map_pos)) {
+        SetMapBlock(map_pos, kAirBlock);
+    }
+}
+
+void Game::IgniteTnt(const glm::ivec3 &map_pos) {
+    ScheduleBlockTick(map_pos, kTntFuseTicks);
+}
+
+bool Game::IsLeafSupported(const glm::ivec3 &map_pos) const {
+    glm::ivec3 begin = ToChunkPos(map_pos - glm::ivec3(kLeafDecayDist));
+    glm::ivec3 end = ToChunkPos(map_pos + glm::ivec3(kLeafDecayDist));
+    for (int cy = begin.y; end.y >= cy; cy++) {
+        for (int cx = begin.x; end.x >= cx; cx++) {
+            for (int cz = begin.z; end.z >= cz; cz++) {
+                if (!FindChunk(glm::ivec3(cx, cy, cz))) {
+                    return true;
+                }
+            }
+        }
+    }
+    for (int dy = -kLeafDecayDist; kLeafDecayDist >= dy; dy++) {
+        for (int dx = -kLeafDecayDist; kLeafDecayDist >= dx; dx++) {
+            for (int dz = -kLeafDecayDist; kLeafDecayDist >= dz; dz++) {
+                if (GetMapBlock(map_pos + glm::ivec3(dx, dy, dz)) == kCherryLogBlock) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+void Game::ClearTicks() {
+    scheduled_ticks_.clear();
+    scheduled_tick_keys_.clear();
+    random_tick_chunks_.clear();
+    pending_explosions_.clear();
+}
+
+void Game::BuildBlastSteps() {
+    blast_steps_.clear();
+    for (int y = 0; kBlastGrid > y; y++) {
+        for (int x = 0; kBlastGrid > x; x++) {
+            for (int z = 0; kBlastGrid > z; z++) {
+                bool surface = x == 0 || x == kBlastGrid - 1 || y == 0 ||
+                    y == kBlastGrid - 1 || z == 0 || z == kBlastGrid - 1;
+                if (!surface) {
+                    continue;
+                }
+                glm::vec3 dir = glm::vec3(x, y, z) * (2.0f / (kBlastGrid - 1))
+                    - glm::vec3(1.0);
+                blast_steps_.push_back(glm::normalize(dir) * kBlastStep);
+            }
+        }
+    }
+    assert(blast_steps_.size() == kNBlastRays);
+}
+
+int Game::ProcessExplosions() {
+    explosions_.clear();
+    while (!pending_explosions_.empty() && kMaxExplosionsPerTick > (int)explosions_.size()) {
+        explosions_.push_back(pending_explosions_.front());
+        pending_explosions_.pop_front();
+    }
+    if (explosions_.empty()) {
+        return 0;
+    }
+
+    // 同じtickの爆発は、どれも爆発する前のMapでRayを飛ばす
+    TraceExplosions(explosions_);
+    // 巻き込まれたTNTは消さずに短い導火線に火を付け、残りはまとめてAirにする
+    blast_removals_.clear();
+    for (long long key : blast_blocks_) {
+        glm::ivec3 map_pos = FromBlockKey(key);
+        if (GetMapBlock(map_pos) == kTntBlock) {
+            ScheduleBlockTick(map_pos, kChainFuseMinTicks
+                + tick_rng_() % (kChainFuseMaxTicks - kChainFuseMinTicks + 1));
+        }
+        else {
+            blast_removals_.push_back(map_pos);
+        }
     }
+    SetMapBlocks(blast_removals_, kAirBlock);
+    return explosions_.size();
 }
 
-void Game::TryMoveZ(float mvz) {
-    pos_.z += mvz;
-    int part_z = mvz < 0 ? 0 : 1;
-    bool hit = HitBlock({
-        glm::ivec3(0, 0, part_z), glm::ivec3(0, 1, part_z), glm::ivec3(0, 2, part_z),
-        glm::ivec3(1, 0, part_z), glm::ivec3(1, 1, part_z), glm::ivec3(1, 2, part_z),
+void Game::TraceExplosions(const std::vector<Explosion> &explosions) {
+    for (std::vector<long long> &hits : blast_hits_) {
+        hits.clear();
+    }
+    // 爆発ごとのRayをkBlastRaysPerTask本ずつに分け、描画と同じスレッドで分担する
+    const int n_tasks = kNBlastRays / kBlastRaysPerTask;
+    tile_pool_->Run(explosions.size() * n_tasks, [&](int task, int thread) {
+        const Explosion &explosion = explosions[task / n_tasks];
+        int begin = task % n_tasks * kBlastRaysPerTask;
+        for (int ray = begin; begin + kBlastRaysPerTask > ray; ray++) {
+            TraceBlastRay(explosion, ray, blast_hits_[thread]);
+        }
     });
-    if (hit) {
-        pos_.z -= mvz;
+
+    blast_blocks_.clear();
+    for (const std::vector<long long> &hits : blast_hits_) {
+        blast_blocks_.insert(blast_blocks_.end(), hits.begin(), hits.end());
+    }
+    // 処理する順序がスレッドの割り当てによらないように並べる
+    std::sort(blast_blocks_.begin(), blast_blocks_.end());
+    blast_blocks_.erase(std::unique(blast_blocks_.begin(), blast_blocks_.end()),
+        blast_blocks_.end());
+}
+
+void Game::TraceBlastRay(const Explosion &explosion, int ray,
+    std::vector<long long> &hits) const {
+    // 強さのばらつき(0.7 ~ 1.3倍)は爆発の種とRayの番号から決める(スレッドによらない)
+    uint32_t hash = explosion.seed ^ (uint32_t)ray * 0x9e3779b9u;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    float intensity = kTntPower * (0.7f + 0.6f * (hash >> 8) / 16777216.0f);
+
+    const glm::vec3 &step = blast_steps_[ray];
+    glm::vec3 pos = glm::vec3(explosion.pos) + glm::vec3(0.5);
+    // 1 Blockの中を数回続けて進むので、直前と同じBlockは引き直さず、足し直さない
+    glm::ivec3 prev_pos = explosion.pos;
+    char block = GetMapBlock(prev_pos);
+    bool added = false;
+    while (intensity > 0.0) {
+        glm::ivec3 map_pos(glm::floor(pos));
+        if (map_pos != prev_pos) {
+            prev_pos = map_pos;
+            block = GetMapBlock(map_pos);
+            added = false;
+        }
+        if (block != kAirBlock) {
+            intensity -= (kBlockBlastResistance[block] + kBlastStep) * kBlastStep;
+            if (intensity > 0.0 && !added) {
+                hits.push_back(ToBlockKey(map_pos));
+                added = true;
+            }
+        }
+        pos += step;
+        intensity -= kBlastStep * 0.75f;
     }
 }
 
 void Game::Quit() {
-    // TODO: LoadされていないMapはSaveしない
-    SaveMap(0);
-    delete buffer_;
+    // Headlessでは読み込みに失敗したときにのみ呼ばれるので、Mapは保存しない
+    if (headless_) {
+        StopChunkIo();
+        tile_pool_.reset();
+        own_buffer_.reset();
+        std::exit(EXIT_FAILURE);
+    }
+    StopRenderThread();
+    SaveMap(map_id_);
+    StopChunkIo();
+    tile_pool_.reset();
+    own_buffer_.reset();
+    own_front_buffer_.reset();
+    // QuickCG::endはexitするので、Profilerのデストラクタを待たずに書き出す
+    profiler_.Export();
     QuickCG::end();
 }
 
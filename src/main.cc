@@ -1,8 +1,122 @@
 #include <cstdlib>
+#include <cstring>
 #include "game.h"
 
-int main() {
+// 使い方:
+//   chibi                                    ゲームを起動する
+//   chibi --bench [frames] [width height]    Headlessで描画速度を計測する
+//   chibi --convert-map [map_id] [raw|rle]   MapをChunkファイルに変換する
+//                                            (map_idは16進数, 既定はrle)
+// 共通のオプション:
+//   --mmap         rawのChunkファイルをmmapして読み込む(変更はコピーオンライト)
+//   --threads N    描画に使うスレッド数(既定はハードウェアのスレッド数)
+//   --render-scale S  描画の解像度の倍率を固定する(0 < S <= 1, 既定は自動で選ぶ)
+//   --no-pipeline  画面への転送が終わってから次のフレームを描く
+//   --gl [S]       OpenGLで画面に転送する(画面の解像度のS倍で描いてGPUで拡大する, 既定は1)
+//   --profile FILE 区間ごとの時間を定期的に書き出す(.jsonなら直近の統計、それ以外はCSV)
+//   --view-dist N  視程(Block単位, Game::kMinViewDist <= N <= Game::kMaxViewDist, 既定は60)
+//                  64より遠くは粗い格子で描く
+// --render-scale, --no-pipeline, --gl, --profileはゲームの画面にだけ効くので、--benchでは使えない
+int main(int argc, char *argv[]) {
+    bool use_mmap = false;
+    int n_threads = 0;
+    float render_scale = 0.0;
+    bool use_pipeline = true;
+    bool use_opengl = false;
+    float opengl_scale = 1.0;
+    std::string profile_path;
+    int view_dist = 0;
+    // 共通のオプションを取り除き、残りを前に詰める
+    int n_args = 1;
+    for (int i = 1; argc > i; i++) {
+        if (std::strcmp(argv[i], "--mmap") == 0) {
+            use_mmap = true;
+        }
+        else if (std::strcmp(argv[i], "--threads") == 0 && argc > i + 1) {
+            n_threads = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--render-scale") == 0 && argc > i + 1) {
+            render_scale = std::atof(argv[++i]);
+            if (render_scale <= 0.0 || render_scale > 1.0) {
+                std::cerr << "Error: Render scale must be in (0, 1]." << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (std::strcmp(argv[i], "--no-pipeline") == 0) {
+            use_pipeline = false;
+        }
+        else if (std::strcmp(argv[i], "--gl") == 0) {
+            use_opengl = true;
+            // 倍率は省略できる
+            if (argc > i + 1 && std::atof(argv[i + 1]) > 0.0) {
+                opengl_scale = std::atof(argv[++i]);
+                if (opengl_scale > 1.0) {
+                    std::cerr << "Error: OpenGL internal scale must be in (0, 1]." << std::endl;
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+        else if (std::strcmp(argv[i], "--profile") == 0 && argc > i + 1) {
+            profile_path = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--view-dist") == 0 && argc > i + 1) {
+            view_dist = std::atoi(argv[++i]);
+            if (view_dist < Game::kMinViewDist || view_dist > Game::kMaxViewDist) {
+                std::cerr << "Error: View distance must be in [" << Game::kMinViewDist
+                    << ", " << Game::kMaxViewDist << "]." << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            argv[n_args++] = argv[i];
+        }
+    }
+    argc = n_args;
+
+    if (argc >= 2 && std::strcmp(argv[1], "--bench") == 0) {
+        // 計測は全ての倍率を順に測り、画面へは転送しないので、これらは使えない
+        if (render_scale > 0.0 || !use_pipeline || use_opengl || !profile_path.empty()) {
+            std::cerr << "Error: --render-scale, --no-pipeline, --gl and --profile "
+                << "cannot be used with --bench." << std::endl;
+            return EXIT_FAILURE;
+        }
+        int n_frames = argc >= 3 ? std::atoi(argv[2]) : 120;
+        if (n_frames <= 0) {
+            std::cerr << "Error: Number of benchmark frames must be positive." << std::endl;
+            return EXIT_FAILURE;
+        }
+        int width = argc >= 5 ? std::atoi(argv[3]) : -1;
+        int height = argc >= 5 ? std::atoi(argv[4]) : -1;
+        Game game(width, height, false, true);
+        game.UseMmap(use_mmap);
+        game.SetNThreads(n_threads);
+        if (view_dist > 0) {
+            game.SetViewDist(view_dist);
+        }
+        game.Benchmark(n_frames);
+        return EXIT_SUCCESS;
+    }
+    if (argc >= 2 && std::strcmp(argv[1], "--convert-map") == 0) {
+        int map_id = argc >= 3 ? std::strtol(argv[2], nullptr, 16) : 0;
+        std::string encoding = argc >= 4 ? argv[3] : "rle";
+        Game game(-1, -1, false, true);
+        game.ConvertMap(map_id, encoding);
+        return EXIT_SUCCESS;
+    }
+
     Game game;
+    game.UseMmap(use_mmap);
+    game.SetNThreads(n_threads);
+    game.LockRenderScale(render_scale);
+    game.UsePipeline(use_pipeline);
+    game.UseOpenGl(use_opengl, opengl_scale);
+    if (view_dist > 0) {
+        game.SetViewDist(view_dist);
+    }
+    if (!profile_path.empty() && !game.ExportProfile(profile_path)) {
+        std::cerr << "Error: Failed to open profile file: " << profile_path << std::endl;
+        return EXIT_FAILURE;
+    }
     game.Start();
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,1040 @@
+#include "game.h"
+
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+Game::Chunk::Chunk(const Chunk &other)
+    : n_solid_blocks(other.n_solid_blocks), dirty(other.dirty),
+      random_tick_blocks(other.random_tick_blocks) {
+    std::memcpy(brick_masks, other.brick_masks, sizeof(brick_masks));
+    std::memcpy(lod_blocks, other.lod_blocks, sizeof(lod_blocks));
+    std::memcpy(lod_brick_masks, other.lod_brick_masks, sizeof(lod_brick_masks));
+    std::memcpy(light, other.light, sizeof(light));
+    std::memcpy(own_blocks, other.blocks, kChunkVolume);
+}
+
+Game::Chunk::~Chunk() {
+    if (mapping) {
+        munmap(mapping, mapping_size);
+    }
+}
+
+void Game::SetMapBlock(int x, int y, int z, char block) {
+    if (!WriteMapBlock(x, y, z, block)) {
+        return;
+    }
+    // 明るさが変わったVoxelに接する面も描き直す
+    InvalidateRenderCache(light_changed_min_, light_changed_max_);
+    redraw_ = true;
+}
+
+void Game::SetMapBlocks(const std::vector<glm::ivec3> &map_poses, char block) {
+    if (map_poses.empty()) {
+        return;
+    }
+    for (const glm::ivec3 &map_pos : map_poses) {
+        WriteMapBlock(map_pos.x, map_pos.y, map_pos.z, block);
+    }
+    // Blockごとに画面の範囲を求めて捨てるより、全て描き直す方が速い
+    render_cache_valid_ = false;
+    redraw_ = true;
+}
+
+bool Game::WriteMapBlock(int x, int y, int z, char block) {
+    assert(0 <= block && block < kNBlocks);
+    auto it = chunks_.find(ToChunkKey(ToChunkPos(x, y, z)));
+    assert(it != chunks_.end());
+    light_changed_min_ = glm::ivec3(x, y, z);
+    light_changed_max_ = glm::ivec3(x, y, z);
+    if (!it->second) {
+        // 全てAirのChunkは共有しているので、書き込む前に複製する
+        if (block == kAirBlock) {
+            return false;
+        }
+        ChunkSlot &slot = chunk_table_[ToChunkTableIndex(ToChunkPos(x, y, z))];
+        it->second.reset(new Chunk(*slot.chunk));
+        slot.chunk = it->second.get();
+    }
+    char old_block = it->second->blocks[ToChunkIndex(x, y, z)];
+    SetChunkBlock(*it->second, ToChunkIndex(x, y, z), block);
+    if (it->second->random_tick_blocks.empty()) {
+        random_tick_chunks_.erase(it->first);
+    }
+    else {
+        random_tick_chunks_.insert(it->first);
+    }
+    if (old_block != block) {
+        UpdateLight(glm::ivec3(x, y, z), old_block);
+    }
+    return true;
+}
+
+void Game::SetChunkBlock(Chunk &chunk, int index, char block) {
+    char &chunk_block = chunk.blocks[index];
+    if (chunk_block == block) {
+        return;
+    }
+    chunk.dirty = true;
+
+    bool old_solid = IsSolidBlock(chunk_block);
+    bool new_solid = IsSolidBlock(block);
+    bool old_random_tick = HasRandomTick(chunk_block);
+    chunk_block = block;
+    if (old_random_tick != HasRandomTick(block)) {
+        std::vector<uint16_t> &ticks = chunk.random_tick_blocks;
+        if (old_random_tick) {
+            // 順序は問わないので、末尾と入れ替えて消す
+            *std::find(ticks.begin(), ticks.end(), index) = ticks.back();
+            ticks.pop_back();
+        }
+        else {
+            ticks.push_back(index);
+        }
+    }
+    // indexの(y, x, z)をそれぞれBrickの番号とBrick内の位置に分ける
+    int x = index >> kChunkShift & kChunkMask;
+    int y = index >> (2 * kChunkShift);
+    int z = index & kChunkMask;
+    // 代表のBlockは衝突しないBlock同士の変更では変わらない
+    if (old_solid || new_solid) {
+        UpdateLod(chunk, x, y, z);
+    }
+    if (old_solid == new_solid) {
+        return;
+    }
+    uint64_t &brick_mask = chunk.brick_masks[ToBrickIndex(x, y, z)];
+    if (new_solid) {
+        brick_mask |= ToBrickBit(x, y, z);
+        chunk.n_solid_blocks++;
+    }
+    else {
+        brick_mask &= ~ToBrickBit(x, y, z);
+        chunk.n_solid_blocks--;
+    }
+}
+
+void Game::BuildBrickMap(Chunk &chunk) {
+    std::fill(std::begin(chunk.brick_masks), std::end(chunk.brick_masks), 0);
+    chunk.n_solid_blocks = 0;
+    chunk.random_tick_blocks.clear();
+    for (int y = 0; kChunkSize > y; y++) {
+        for (int x = 0; kChunkSize > x; x++) {
+            for (int z = 0; kChunkSize > z; z++) {
+                char block = chunk.blocks[ToChunkIndex(x, y, z)];
+                if (IsSolidBlock(block)) {
+                    chunk.brick_masks[ToBrickIndex(x, y, z)] |= ToBrickBit(x, y, z);
+                    chunk.n_solid_blocks++;
+                }
+                if (HasRandomTick(block)) {
+                    chunk.random_tick_blocks.push_back(ToChunkIndex(x, y, z));
+                }
+            }
+        }
+    }
+}
+
+void Game::BuildLod(Chunk &chunk) {
+    // BuildBrickMapの後に呼ぶ
+    std::fill(std::begin(chunk.lod_brick_masks), std::end(chunk.lod_brick_masks), 0);
+    if (chunk.n_solid_blocks == 0) {
+        std::memset(chunk.lod_blocks, kAirBlock, kLodVolume);
+        return;
+    }
+    for (int level = 1; kNLodLevels >= level; level++) {
+        int size = kChunkSize >> level;
+        for (int y = 0; size > y; y++) {
+            for (int x = 0; size > x; x++) {
+                for (int z = 0; size > z; z++) {
+                    char block = CalcLodBlock(chunk, level, x, y, z);
+                    chunk.lod_blocks[ToLodIndex(level, x, y, z)] = block;
+                    if (IsSolidBlock(block)) {
+                        chunk.lod_brick_masks[ToLodBrickIndex(level, x, y, z)] |=
+                            ToLodBrickBit(level, x, y, z);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void Game::UpdateLod(Chunk &chunk, int x, int y, int z) {
+    for (int level = 1; kNLodLevels >= level; level++) {
+        int lx = x >> level, ly = y >> level, lz = z >> level;
+        char block = CalcLodBlock(chunk, level, lx, ly, lz);
+        chunk.lod_blocks[ToLodIndex(level, lx, ly, lz)] = block;
+        uint64_t &brick_mask = chunk.lod_brick_masks[ToLodBrickIndex(level, lx, ly, lz)];
+        if (IsSolidBlock(block)) {
+            brick_mask |= ToLodBrickBit(level, lx, ly, lz);
+        }
+        else {
+            brick_mask &= ~ToLodBrickBit(level, lx, ly, lz);
+        }
+    }
+}
+
+char Game::CalcLodBlock(const Chunk &chunk, int level, int x, int y, int z) {
+    // ほとんどのセルは空か1種類のBlockだけなので、まず衝突するBlockの数と
+    // 2種類以上あるかだけを調べる
+    int size = 1 << level;
+    int n_solid_blocks = 0;
+    char first_block = kAirBlock;
+    bool mixed = false;
+    for (int dy = 0; size > dy; dy++) {
+        for (int dx = 0; size > dx; dx++) {
+            for (int dz = 0; size > dz; dz++) {
+                char block = chunk.blocks[ToChunkIndex(
+                    (x << level) + dx, (y << level) + dy, (z << level) + dz)];
+                if (IsSolidBlock(block)) {
+                    n_solid_blocks++;
+                    mixed |= first_block != kAirBlock && block != first_block;
+                    first_block = block;
+                }
+            }
+        }
+    }
+    if (2 * n_solid_blocks < size * size * size) {
+        return kAirBlock;
+    }
+    if (!mixed) {
+        return first_block;
+    }
+    // 種類ごとに数えて、最も多いBlockを選ぶ
+    int counts[kNBlocks] = {};
+    for (int dy = 0; size > dy; dy++) {
+        for (int dx = 0; size > dx; dx++) {
+            for (int dz = 0; size > dz; dz++) {
+                char block = chunk.blocks[ToChunkIndex(
+                    (x << level) + dx, (y << level) + dy, (z << level) + dz)];
+                if (IsSolidBlock(block)) {
+                    counts[(int)block]++;
+                }
+            }
+        }
+    }
+    return std::max_element(std::begin(counts), std::end(counts)) - std::begin(counts);
+}
+
+void Game::LoadMap(int mid) {
+    StopChunkIo();
+    map_id_ = mid;
+    chunks_.clear();
+    loading_chunks_.clear();
+    ClearTicks();
+    // どのChunkのKeyとも一致しないKey(ToChunkKeyは63bit目を使わない)
+    chunk_table_.assign(kChunkTableSize, ChunkSlot{ -1, nullptr });
+    std::memset(empty_chunk_.blocks, kAirBlock, kChunkVolume);
+    BuildBrickMap(empty_chunk_);
+    BuildLod(empty_chunk_);
+    std::memset(empty_chunk_.light, kMaxLight << kSkyLightShift, kChunkVolume);
+    empty_chunk_.dirty = false;
+    std::memset(dark_empty_chunk_.blocks, kAirBlock, kChunkVolume);
+    BuildBrickMap(dark_empty_chunk_);
+    BuildLod(dark_empty_chunk_);
+    std::memset(dark_empty_chunk_.light, 0, kChunkVolume);
+    dark_empty_chunk_.dirty = false;
+
+    // 旧形式のMapがあれば、Chunkのファイルがない部分はそこから読み込む
+    std::string mfn = ToMapFileName(mid);
+    std::ifstream ifs(mfn, std::ios::binary);
+    if (ifs) {
+        ifs.seekg(0, std::ios::end);
+        int file_size = ifs.tellg();
+        int map_size = kMapHeight * kMapDepth * kMapWidth;
+        if (file_size < map_size) {
+            std::cerr << "Error: Failed to load map." << std::endl;
+            Quit();
+        }
+    }
+    StartChunkIo();
+}
+
+void Game::SaveMap(int mid) {
+    assert(mid == map_id_);
+    {
+        std::lock_guard<std::mutex> lock(chunk_io_mutex_);
+        for (auto &entry : chunks_) {
+            if (entry.second && entry.second->dirty) {
+                entry.second->dirty = false;
+                // mmapしたChunkも複製して、他と同じく別名で書いてから置き換える
+                save_requests_.push_back({ FromChunkKey(entry.first),
+                    std::unique_ptr<Chunk>(new Chunk(*entry.second)) });
+            }
+        }
+    }
+    chunk_io_cv_.notify_one();
+    WaitChunkIo();
+}
+
+void Game::UpdateChunks(bool force) {
+    ReceiveLoadedChunks();
+
+    glm::ivec3 center = ToChunkPos(glm::ivec3(glm::floor(pos_)));
+    if (!force && center == center_chunk_pos_) {
+        return;
+    }
+    center_chunk_pos_ = center;
+
+    // 遠くのChunkを解放する(変更されていれば保存を依頼する)
+    std::vector<glm::ivec3> unloads;
+    for (const auto &entry : chunks_) {
+        glm::ivec3 chunk_pos = FromChunkKey(entry.first);
+        if (!IsInChunkLoadRange(chunk_pos, 1)) {
+            unloads.push_back(chunk_pos);
+        }
+    }
+    std::vector<ChunkSaveRequest> saves;
+    if (!unloads.empty()) {
+        UnloadChunks(unloads, saves);
+    }
+
+    std::vector<glm::ivec3> loads;
+    for (int dy = -chunk_load_height_; chunk_load_height_ >= dy; dy++) {
+        for (int dx = -chunk_load_dist_; chunk_load_dist_ >= dx; dx++) {
+            for (int dz = -chunk_load_dist_; chunk_load_dist_ >= dz; dz++) {
+                glm::ivec3 chunk_pos = center + glm::ivec3(dx, dy, dz);
+                long long key = ToChunkKey(chunk_pos);
+                if (chunks_.find(key) == chunks_.end() &&
+                    loading_chunks_.insert(key).second) {
+                    loads.push_back(chunk_pos);
+                }
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(chunk_io_mutex_);
+        for (ChunkSaveRequest &save : saves) {
+            save_requests_.push_back(std::move(save));
+        }
+        for (const glm::ivec3 &chunk_pos : loads) {
+            load_requests_.push_back({ 0, chunk_pos });
+        }
+        ReprioritizeChunkLoads();
+    }
+    chunk_io_cv_.notify_one();
+}
+
+void Game::ReprioritizeChunkLoads() {
+    // 遠くなったChunkの読み込みは取り消す
+    auto end = std::remove_if(load_requests_.begin(), load_requests_.end(),
+        [this](const ChunkLoadRequest &request) {
+            if (!IsInChunkLoadRange(request.chunk_pos, 0)) {
+                loading_chunks_.erase(ToChunkKey(request.chunk_pos));
+                return true;
+            }
+            return false;
+        });
+    load_requests_.erase(end, load_requests_.end());
+    for (ChunkLoadRequest &request : load_requests_) {
+        glm::ivec3 dist = request.chunk_pos - center_chunk_pos_;
+        request.priority = dist.x * dist.x + dist.y * dist.y + dist.z * dist.z;
+    }
+    std::make_heap(load_requests_.begin(), load_requests_.end());
+}
+
+void Game::ReceiveLoadedChunks() {
+    std::vector<ChunkSaveRequest> loaded;
+    {
+        std::lock_guard<std::mutex> lock(chunk_io_mutex_);
+        loaded.swap(loaded_chunks_);
+    }
+    // 上のChunkから入れると、下のChunkに入れた空の光を消し直さなくてよい
+    std::stable_sort(loaded.begin(), loaded.end(),
+        [](const ChunkSaveRequest &a, const ChunkSaveRequest &b) {
+            return a.chunk_pos.y > b.chunk_pos.y;
+        });
+    for (ChunkSaveRequest &entry : loaded) {
+        long long key = ToChunkKey(entry.chunk_pos);
+        loading_chunks_.erase(key);
+        // 読み込んでいる間に遠くへ移動していたら捨てる
+        if (!IsInChunkLoadRange(entry.chunk_pos, 1) ||
+            chunks_.find(key) != chunks_.end()) {
+            continue;
+        }
+        InsertChunk(entry.chunk_pos, std::move(entry.chunk));
+    }
+}
+
+void Game::InsertChunk(const glm::ivec3 &chunk_pos, std::unique_ptr<Chunk> chunk) {
+    long long key = ToChunkKey(chunk_pos);
+    if (chunks_.find(key) != chunks_.end()) {
+        std::vector<ChunkSaveRequest> discarded;
+        UnloadChunks({ chunk_pos }, discarded);
+    }
+    ChunkSlot &slot = chunk_table_[ToChunkTableIndex(chunk_pos)];
+    slot.key = key;
+    if (chunk) {
+        slot.chunk = chunk.get();
+    }
+    else {
+        // 上から空の光の15が真下へ届くときだけ、全て15のChunkを共有する
+        const Chunk *above = FindChunk(chunk_pos + glm::ivec3(0, 1, 0));
+        slot.chunk = !above || above == &empty_chunk_ ? &empty_chunk_ : &dark_empty_chunk_;
+    }
+    if (chunk && !chunk->random_tick_blocks.empty()) {
+        random_tick_chunks_.insert(key);
+    }
+    else {
+        random_tick_chunks_.erase(key);
+    }
+    chunks_[key] = std::move(chunk);
+    BuildLight(chunk_pos);
+    // 新しく見えるようになったBlockや、明るさが変わったBlockがあるかもしれない
+    render_cache_valid_ = false;
+    redraw_ = true;
+}
+
+void Game::UnloadChunks(const std::vector<glm::ivec3> &chunk_poses,
+    std::vector<ChunkSaveRequest> &saves) {
+    std::unordered_set<long long> unloading;
+    for (const glm::ivec3 &chunk_pos : chunk_poses) {
+        unloading.insert(ToChunkKey(chunk_pos));
+    }
+    // 解放するChunkから届いていた光を消すため、周りのChunkに接する面の明るさを覚えておく
+    // 共有しているChunkの明るさは、解放するChunkから届いたものではない
+    const int shifts[2] = { kSkyLightShift, kBlockLightShift };
+    std::vector<LightRemoval> removals[2];
+    for (const glm::ivec3 &chunk_pos : chunk_poses) {
+        const Chunk *chunk = FindChunk(chunk_pos);
+        for (int axis = 0; 3 > axis; axis++) {
+            int u = (axis + 1) % 3, v = (axis + 2) % 3;
+            for (int side = 0; 2 > side; side++) {
+                glm::ivec3 neighbor_pos = chunk_pos;
+                neighbor_pos[axis] += side ? 1 : -1;
+                const Chunk *neighbor = FindChunk(neighbor_pos);
+                if (!neighbor || IsSharedChunk(neighbor) ||
+                    unloading.count(ToChunkKey(neighbor_pos))) {
+                    continue;
+                }
+                glm::ivec3 origin = ToChunkFaceOrigin(chunk_pos, axis, side, false);
+                for (int i = 0; kChunkSize > i; i++) {
+                    for (int j = 0; kChunkSize > j; j++) {
+                        glm::ivec3 map_pos = origin;
+                        map_pos[u] += i;
+                        map_pos[v] += j;
+                        uint8_t light =
+                            chunk->light[ToChunkIndex(map_pos.x, map_pos.y, map_pos.z)];
+                        for (int k = 0; 2 > k; k++) {
+                            // 下のChunkの最上段は空の光の光源になり、明るさは減らない
+                            if (shifts[k] == kSkyLightShift && axis == 1 && side == 0) {
+                                continue;
+                            }
+                            int level = light >> shifts[k] & kMaxLight;
+                            if (level > 0) {
+                                removals[k].push_back({ map_pos, level });
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // 変更されていれば保存を依頼する
+    for (const glm::ivec3 &chunk_pos : chunk_poses) {
+        auto it = chunks_.find(ToChunkKey(chunk_pos));
+        assert(it != chunks_.end());
+        if (it->second && it->second->dirty) {
+            saves.push_back({ chunk_pos, std::move(it->second) });
+        }
+        ChunkSlot &slot = chunk_table_[ToChunkTableIndex(chunk_pos)];
+        slot.key = -1;
+        slot.chunk = nullptr;
+        random_tick_chunks_.erase(it->first);
+        chunks_.erase(it);
+    }
+
+    // 消えたChunkの位置から光を消し、残った光源から広げ直す
+    for (int k = 0; 2 > k; k++) {
+        light_removal_queue_.swap(removals[k]);
+        RemoveLight(shifts[k]);
+        if (shifts[k] == kSkyLightShift) {
+            for (const glm::ivec3 &chunk_pos : chunk_poses) {
+                glm::ivec3 below = chunk_pos - glm::ivec3(0, 1, 0);
+                if (FindChunk(below)) {
+                    LightChunkTop(below);
+                }
+            }
+        }
+        SpreadLight(shifts[k]);
+    }
+    ShareEmptyChunks();
+    render_cache_valid_ = false;
+    redraw_ = true;
+}
+
+Game::Chunk *Game::UnshareChunk(const glm::ivec3 &chunk_pos) {
+    ChunkSlot &slot = chunk_table_[ToChunkTableIndex(chunk_pos)];
+    if (slot.key != ToChunkKey(chunk_pos)) {
+        return nullptr;
+    }
+    if (IsSharedChunk(slot.chunk)) {
+        std::unique_ptr<Chunk> &chunk = chunks_.at(slot.key);
+        chunk.reset(new Chunk(*slot.chunk));
+        slot.chunk = chunk.get();
+        light_copied_chunks_.push_back(chunk_pos);
+    }
+    // chunk_table_はRayを進めるためにconstで持つが、共有していないChunkはchunks_のもの
+    return const_cast<Chunk *>(slot.chunk);
+}
+
+void Game::ShareEmptyChunks() {
+    for (const glm::ivec3 &chunk_pos : light_copied_chunks_) {
+        auto it = chunks_.find(ToChunkKey(chunk_pos));
+        // Blockを書き込んだChunkは共有に戻さない
+        if (it == chunks_.end() || !it->second || it->second->dirty) {
+            continue;
+        }
+        const Chunk *shared = nullptr;
+        if (std::memcmp(it->second->light, empty_chunk_.light, kChunkVolume) == 0) {
+            shared = &empty_chunk_;
+        }
+        else if (std::memcmp(it->second->light, dark_empty_chunk_.light, kChunkVolume) == 0) {
+            shared = &dark_empty_chunk_;
+        }
+        if (shared) {
+            it->second.reset();
+            chunk_table_[ToChunkTableIndex(chunk_pos)].chunk = shared;
+        }
+    }
+    light_copied_chunks_.clear();
+}
+
+void Game::QueueChunkFace(const glm::ivec3 &chunk_pos, int axis, int side, bool outside) {
+    int u = (axis + 1) % 3, v = (axis + 2) % 3;
+    glm::ivec3 origin = ToChunkFaceOrigin(chunk_pos, axis, side, outside);
+    for (int i = 0; kChunkSize > i; i++) {
+        for (int j = 0; kChunkSize > j; j++) {
+            glm::ivec3 map_pos = origin;
+            map_pos[u] += i;
+            map_pos[v] += j;
+            light_queue_.push_back(map_pos);
+        }
+    }
+}
+
+void Game::LightChunkTop(const glm::ivec3 &chunk_pos) {
+    const Chunk *chunk = FindChunk(chunk_pos);
+    if (chunk == &empty_chunk_) {
+        return;
+    }
+    glm::ivec3 origin = ToChunkFaceOrigin(chunk_pos, 1, 1, false);
+    for (int x = 0; kChunkSize > x; x++) {
+        for (int z = 0; kChunkSize > z; z++) {
+            glm::ivec3 map_pos = origin + glm::ivec3(x, 0, z);
+            int index = ToChunkIndex(map_pos.x, map_pos.y, map_pos.z);
+            if (IsSolidBlock(chunk->blocks[index]) ||
+                (chunk->light[index] >> kSkyLightShift & kMaxLight) == kMaxLight) {
+                continue;
+            }
+            Chunk *light_chunk = UnshareChunk(chunk_pos);
+            SetLight(*light_chunk, map_pos, kSkyLightShift, kMaxLight);
+            light_queue_.push_back(map_pos);
+            chunk = light_chunk;
+        }
+    }
+}
+
+void Game::BuildLight(const glm::ivec3 &chunk_pos) {
+    const Chunk *chunk = FindChunk(chunk_pos);
+    Chunk *own_chunk = IsSharedChunk(chunk) ? nullptr : UnshareChunk(chunk_pos);
+    if (own_chunk) {
+        std::memset(own_chunk->light, 0, kChunkVolume);
+    }
+    // 読み込まれていないChunkとは光をやり取りしないので、読み込むと明るさは増えるだけ
+    // ただし、下のChunkの最上段の空の光の15は光源でなくなるので消す
+    glm::ivec3 below = chunk_pos - glm::ivec3(0, 1, 0);
+    const Chunk *below_chunk = FindChunk(below);
+    if (chunk != &empty_chunk_ && below_chunk && below_chunk != &dark_empty_chunk_) {
+        glm::ivec3 origin = ToChunkFaceOrigin(chunk_pos, 1, 0, true);
+        for (int x = 0; kChunkSize > x; x++) {
+            for (int z = 0; kChunkSize > z; z++) {
+                glm::ivec3 map_pos = origin + glm::ivec3(x, 0, z);
+                if ((GetMapLight(map_pos) >> kSkyLightShift & kMaxLight) == kMaxLight) {
+                    SetLight(*UnshareChunk(below), map_pos, kSkyLightShift, 0);
+                    light_removal_queue_.push_back({ map_pos, kMaxLight });
+                }
+            }
+        }
+        RemoveLight(kSkyLightShift);
+    }
+    if (IsSkyExposed(chunk_pos)) {
+        LightChunkTop(chunk_pos);
+    }
+    // 中身のあるChunkへは接するVoxelから、空の光が全て15のChunkからは自分の面のVoxelから広げる
+    for (int shift : { kSkyLightShift, kBlockLightShift }) {
+        for (int axis = 0; 3 > axis; axis++) {
+            for (int side = 0; 2 > side; side++) {
+                glm::ivec3 neighbor_pos = chunk_pos;
+                neighbor_pos[axis] += side ? 1 : -1;
+                const Chunk *neighbor = FindChunk(neighbor_pos);
+                if (!neighbor) {
+                    continue;
+                }
+                if (chunk == &empty_chunk_ && shift == kSkyLightShift) {
+                    if (neighbor != &empty_chunk_) {
+                        QueueChunkFace(chunk_pos, axis, side, false);
+                    }
+                }
+                // 共有しているChunkにはBlockの光がない
+                else if (!IsSharedChunk(neighbor) ||
+                    (neighbor == &empty_chunk_ && shift == kSkyLightShift)) {
+                    QueueChunkFace(chunk_pos, axis, side, true);
+                }
+            }
+        }
+        if (own_chunk && shift == kBlockLightShift) {
+            for (int index = 0; kChunkVolume > index; index++) {
+                int emission = kBlockLightEmission[own_chunk->blocks[index]];
+                if (emission > 0) {
+                    glm::ivec3 map_pos = chunk_pos * kChunkSize + glm::ivec3(
+                        index >> kChunkShift & kChunkMask, index >> (2 * kChunkShift),
+                        index & kChunkMask);
+                    SetLight(*own_chunk, map_pos, shift, emission);
+                    light_queue_.push_back(map_pos);
+                }
+            }
+        }
+        SpreadLight(shift);
+    }
+    ShareEmptyChunks();
+}
+
+void Game::UpdateLight(const glm::ivec3 &map_pos, char old_block) {
+    Chunk *chunk = UnshareChunk(ToChunkPos(map_pos));
+    assert(chunk);
+    int index = ToChunkIndex(map_pos.x, map_pos.y, map_pos.z);
+    char block = chunk->blocks[index];
+    // 光を通すかと光る強さが変わらなければ、明るさも変わらない
+    if (IsSolidBlock(old_block) == IsSolidBlock(block) &&
+        kBlockLightEmission[old_block] == kBlockLightEmission[block]) {
+        return;
+    }
+    // 上のChunkが読み込まれていない最上段のVoxelは、空の光の光源
+    bool sky_source = !IsSolidBlock(block) && (map_pos.y & kChunkMask) == kChunkMask &&
+        IsSkyExposed(ToChunkPos(map_pos));
+    for (int shift : { kSkyLightShift, kBlockLightShift }) {
+        // このVoxelを通っていた光を一度消し、消えた範囲の外側とこのVoxelから広げ直す
+        int level = chunk->light[index] >> shift & kMaxLight;
+        if (level > 0) {
+            SetLight(*chunk, map_pos, shift, 0);
+            light_removal_queue_.push_back({ map_pos, level });
+            RemoveLight(shift);
+        }
+        int emission = shift == kBlockLightShift ? kBlockLightEmission[block]
+            : sky_source ? kMaxLight : 0;
+        if (emission > 0) {
+            SetLight(*chunk, map_pos, shift, emission);
+            light_queue_.push_back(map_pos);
+        }
+        if (!IsSolidBlock(block)) {
+            for (int axis = 0; 3 > axis; axis++) {
+                for (int sign = -1; 1 >= sign; sign += 2) {
+                    glm::ivec3 next = map_pos;
+                    next[axis] += sign;
+                    if (FindChunk(ToChunkPos(next))) {
+                        light_queue_.push_back(next);
+                    }
+                }
+            }
+        }
+        SpreadLight(shift);
+    }
+    ShareEmptyChunks();
+}
+
+void Game::RemoveLight(int shift) {
+    for (size_t head = 0; light_removal_queue_.size() > head; head++) {
+        LightRemoval removal = light_removal_queue_[head];
+        for (int axis = 0; 3 > axis; axis++) {
+            for (int sign = -1; 1 >= sign; sign += 2) {
+                glm::ivec3 next = removal.pos;
+                next[axis] += sign;
+                const Chunk *chunk = FindChunk(ToChunkPos(next));
+                if (!chunk) {
+                    continue;
+                }
+                int level = chunk->light[ToChunkIndex(next.x, next.y, next.z)] >> shift
+                    & kMaxLight;
+                // 真下の15は、消した空の光が弱まらずに届いていたもの
+                bool sky_below = shift == kSkyLightShift && axis == 1 && sign < 0 &&
+                    removal.level == kMaxLight;
+                if (level != 0 && (level < removal.level || sky_below)) {
+                    SetLight(*UnshareChunk(ToChunkPos(next)), next, shift, 0);
+                    light_removal_queue_.push_back({ next, level });
+                }
+                else if (level >= removal.level) {
+                    // 別の光源から届いている光なので、消えた範囲へ広げ直す
+                    light_queue_.push_back(next);
+                }
+            }
+        }
+    }
+    light_removal_queue_.clear();
+}
+
+void Game::SpreadLight(int shift) {
+    for (size_t head = 0; light_queue_.size() > head; head++) {
+        glm::ivec3 pos = light_queue_[head];
+        int level = GetMapLight(pos) >> shift & kMaxLight;
+        if (level <= 1) {
+            continue;
+        }
+        for (int axis = 0; 3 > axis; axis++) {
+            for (int sign = -1; 1 >= sign; sign += 2) {
+                glm::ivec3 next = pos;
+                next[axis] += sign;
+                const Chunk *chunk = FindChunk(ToChunkPos(next));
+                if (!chunk) {
+                    continue;
+                }
+                int index = ToChunkIndex(next.x, next.y, next.z);
+                if (IsSolidBlock(chunk->blocks[index])) {
+                    continue;
+                }
+                bool sky_below = shift == kSkyLightShift && axis == 1 && sign < 0 &&
+                    level == kMaxLight;
+                int next_level = sky_below ? kMaxLight : level - 1;
+                if ((chunk->light[index] >> shift & kMaxLight) < next_level) {
+                    SetLight(*UnshareChunk(ToChunkPos(next)), next, shift, next_level);
+                    light_queue_.push_back(next);
+                }
+            }
+        }
+    }
+    light_queue_.clear();
+}
+
+void Game::SetLight(Chunk &chunk, const glm::ivec3 &map_pos, int shift, int level) {
+    uint8_t &light = chunk.light[ToChunkIndex(map_pos.x, map_pos.y, map_pos.z)];
+    light = (light & ~(kMaxLight << shift)) | level << shift;
+    light_changed_min_ = glm::min(light_changed_min_, map_pos);
+    light_changed_max_ = glm::max(light_changed_max_, map_pos);
+}
+
+void Game::StartChunkIo() {
+    assert(!chunk_io_thread_.joinable());
+    chunk_io_quit_ = false;
+    chunk_io_thread_ = std::thread(&Game::ChunkIoLoop, this);
+}
+
+void Game::StopChunkIo() {
+    if (!chunk_io_thread_.joinable()) {
+        return;
+    }
+    {
+        // 読み込みは取り消すが、保存は全て終えてから止める
+        std::lock_guard<std::mutex> lock(chunk_io_mutex_);
+        for (const ChunkLoadRequest &request : load_requests_) {
+            loading_chunks_.erase(ToChunkKey(request.chunk_pos));
+        }
+        load_requests_.clear();
+        chunk_io_quit_ = true;
+    }
+    chunk_io_cv_.notify_one();
+    chunk_io_thread_.join();
+}
+
+void Game::WaitChunkIo() {
+    std::unique_lock<std::mutex> lock(chunk_io_mutex_);
+    chunk_io_idle_cv_.wait(lock, [this] {
+        return load_requests_.empty() && save_requests_.empty() && !chunk_io_busy_;
+    });
+}
+
+void Game::ChunkIoLoop() {
+    std::unique_lock<std::mutex> lock(chunk_io_mutex_);
+    while (true) {
+        chunk_io_cv_.wait(lock, [this] {
+            return chunk_io_quit_ || !save_requests_.empty() || !load_requests_.empty();
+        });
+        if (!save_requests_.empty()) {
+            ChunkSaveRequest request = std::move(save_requests_.front());
+            save_requests_.pop_front();
+            chunk_io_busy_ = true;
+            lock.unlock();
+            WriteChunkFile(request.chunk_pos, *request.chunk);
+            lock.lock();
+        }
+        else if (!load_requests_.empty()) {
+            std::pop_heap(load_requests_.begin(), load_requests_.end());
+            glm::ivec3 chunk_pos = load_requests_.back().chunk_pos;
+            load_requests_.pop_back();
+            chunk_io_busy_ = true;
+            lock.unlock();
+            std::unique_ptr<Chunk> chunk = ReadChunk(chunk_pos);
+            lock.lock();
+            loaded_chunks_.push_back({ chunk_pos, std::move(chunk) });
+        }
+        else {
+            break;
+        }
+        chunk_io_busy_ = false;
+        chunk_io_idle_cv_.notify_all();
+    }
+}
+
+std::unique_ptr<Game::Chunk> Game::ReadChunk(const glm::ivec3 &chunk_pos) {
+    std::unique_ptr<Chunk> chunk(new Chunk);
+    if (!(use_mmap_ && MapChunkFile(chunk_pos, *chunk)) &&
+        !ReadChunkFile(chunk_pos, *chunk) && !ReadLegacyChunk(chunk_pos, *chunk)) {
+        std::memset(chunk->blocks, kAirBlock, kChunkVolume);
+    }
+    chunk->dirty = false;
+    BuildBrickMap(*chunk);
+    BuildLod(*chunk);
+
+    // 全てAirのChunkはempty_chunk_を共有する
+    bool empty = chunk->n_solid_blocks == 0 &&
+        std::all_of(chunk->blocks, chunk->blocks + kChunkVolume,
+            [](char block) { return block == kAirBlock; });
+    if (empty) {
+        chunk.reset();
+    }
+    return chunk;
+}
+
+bool Game::ReadChunkFile(const glm::ivec3 &chunk_pos, Chunk &chunk) {
+    std::ifstream ifs(ToChunkFileName(map_id_, chunk_pos), std::ios::binary);
+    if (!ifs) {
+        return false;
+    }
+    ChunkFileHeader header;
+    ifs.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (ifs.gcount() != sizeof(header) ||
+        std::memcmp(header.magic, kChunkFileMagic, sizeof(header.magic)) != 0) {
+        // Headerのない旧形式(Blockの列のみ)
+        ifs.clear();
+        ifs.seekg(0);
+        header.encoding = kChunkEncodingRaw;
+        header.data_size = kChunkVolume;
+    }
+    else if (header.version > kChunkFileVersion ||
+        header.data_size > kChunkVolume * 3) {
+        std::cerr << "Error: Unsupported chunk file: "
+            << ToChunkFileName(map_id_, chunk_pos) << std::endl;
+        return false;
+    }
+    std::vector<char> data(header.data_size);
+    ifs.read(data.data(), data.size());
+    if (ifs.gcount() != static_cast<std::streamsize>(data.size()) ||
+        !DecodeChunk(static_cast<ChunkEncoding>(header.encoding), data, chunk)) {
+        std::cerr << "Error: Failed to load chunk: "
+            << ToChunkFileName(map_id_, chunk_pos) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void Game::EncodeChunk(const Chunk &chunk, ChunkEncoding encoding,
+    std::vector<char> &data) {
+    data.clear();
+    if (encoding == kChunkEncodingRaw) {
+        data.assign(chunk.blocks, chunk.blocks + kChunkVolume);
+        return;
+    }
+    assert(encoding == kChunkEncodingRle);
+    for (int i = 0; kChunkVolume > i; ) {
+        char block = chunk.blocks[i];
+        int len = 1;
+        while (kChunkVolume > i + len && chunk.blocks[i + len] == block) {
+            len++;
+        }
+        data.push_back(len & 0xff);
+        data.push_back(len >> 8 & 0xff);
+        data.push_back(block);
+        i += len;
+    }
+}
+
+bool Game::DecodeChunk(ChunkEncoding encoding, const std::vector<char> &data,
+    Chunk &chunk) {
+    if (encoding == kChunkEncodingRaw) {
+        if (data.size() != kChunkVolume) {
+            return false;
+        }
+        std::memcpy(chunk.blocks, data.data(), kChunkVolume);
+        return true;
+    }
+    if (encoding != kChunkEncodingRle || data.size() % 3 != 0) {
+        return false;
+    }
+    // 1Blockずつではなく、連続ごとにmemsetで埋める
+    const unsigned char *runs = reinterpret_cast<const unsigned char *>(data.data());
+    int n_blocks = 0;
+    for (size_t i = 0; data.size() > i; i += 3) {
+        int len = runs[i] | runs[i + 1] << 8;
+        if (len == 0 || n_blocks + len > kChunkVolume) {
+            return false;
+        }
+        std::memset(chunk.blocks + n_blocks, runs[i + 2], len);
+        n_blocks += len;
+    }
+    return n_blocks == kChunkVolume;
+}
+
+bool Game::MapChunkFile(const glm::ivec3 &chunk_pos, Chunk &chunk) {
+    int fd = open(ToChunkFileName(map_id_, chunk_pos).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    // rawで保存されたChunkファイル(Headerなしの旧形式も含む)だけをmmapできる
+    struct stat st;
+    size_t offset = 0;
+    bool raw = fstat(fd, &st) == 0;
+    if (raw && st.st_size == sizeof(ChunkFileHeader) + kChunkVolume) {
+        ChunkFileHeader header;
+        raw = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+            std::memcmp(header.magic, kChunkFileMagic, sizeof(header.magic)) == 0 &&
+            header.version <= kChunkFileVersion &&
+            header.encoding == kChunkEncodingRaw && header.data_size == kChunkVolume;
+        offset = sizeof(header);
+    }
+    else {
+        raw = raw && st.st_size == kChunkVolume;
+    }
+    void *mapping = MAP_FAILED;
+    if (raw) {
+        // MAP_PRIVATEなので、変更したPageは複製されてファイルには書き戻されない
+        mapping = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    chunk.mapping = mapping;
+    chunk.mapping_size = st.st_size;
+    chunk.blocks = static_cast<char *>(mapping) + offset;
+    return true;
+}
+
+bool Game::ReadLegacyChunk(const glm::ivec3 &chunk_pos, Chunk &chunk) {
+    glm::ivec3 origin = chunk_pos * kChunkSize;
+    if (origin.x < 0 || origin.x >= kMapWidth || origin.y < 0 ||
+        origin.y >= kMapHeight || origin.z < 0 || origin.z >= kMapDepth) {
+        return false;
+    }
+    std::ifstream ifs(ToMapFileName(map_id_), std::ios::binary);
+    if (!ifs) {
+        return false;
+    }
+    // 旧形式のMapは(y, x, z)の順に並んでいるので、z方向の16Blockずつ読む
+    for (int y = 0; kChunkSize > y; y++) {
+        for (int x = 0; kChunkSize > x; x++) {
+            ifs.seekg((origin.y + y) * kMapWidth * kMapDepth
+                + (origin.x + x) * kMapDepth + origin.z);
+            ifs.read(chunk.blocks + ToChunkIndex(x, y, 0), kChunkSize);
+        }
+    }
+    return true;
+}
+
+void Game::WriteChunkFile(const glm::ivec3 &chunk_pos, const Chunk &chunk) {
+    std::error_code ec;
+    std::filesystem::create_directories(ToChunkDirName(map_id_), ec);
+
+    ChunkFileHeader header;
+    std::memcpy(header.magic, kChunkFileMagic, sizeof(header.magic));
+    header.version = kChunkFileVersion;
+    header.encoding = chunk_encoding_;
+    std::vector<char> data;
+    EncodeChunk(chunk, chunk_encoding_, data);
+    if (data.size() > kChunkVolume) {
+        header.encoding = kChunkEncodingRaw;
+        EncodeChunk(chunk, kChunkEncodingRaw, data);
+    }
+    header.data_size = data.size();
+
+    // 書き込み中に終了してもファイルが壊れないように、別名で書いてから置き換える
+    std::string cfn = ToChunkFileName(map_id_, chunk_pos);
+    std::string tmp_cfn = cfn + ".tmp";
+    {
+        std::ofstream ofs(tmp_cfn, std::ios::binary);
+        if (!ofs) {
+            std::cerr << "Error: Failed to save chunk: " << cfn << std::endl;
+            return;
+        }
+        ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        ofs.write(data.data(), data.size());
+    }
+    std::filesystem::rename(tmp_cfn, cfn, ec);
+    if (ec) {
+        std::cerr << "Error: Failed to save chunk: " << cfn << std::endl;
+    }
+}
+
+void Game::UseMmap(bool use_mmap) {
+    assert(!chunk_io_thread_.joinable());
+    use_mmap_ = use_mmap;
+    // 次に読み込むときにmmapできるように、rawで保存する
+    chunk_encoding_ = use_mmap ? kChunkEncodingRaw : kChunkEncodingRle;
+}
+
+void Game::ConvertMap(int mid, const std::string &encoding) {
+    assert(headless_);
+    if (encoding == "raw") {
+        chunk_encoding_ = kChunkEncodingRaw;
+    }
+    else if (encoding == "rle") {
+        chunk_encoding_ = kChunkEncodingRle;
+    }
+    else {
+        std::cerr << "Error: Unknown chunk encoding: " << encoding << std::endl;
+        Quit();
+    }
+    map_id_ = mid;
+
+    // 変換するChunk: 旧形式のMapの範囲 + 既にファイルのあるChunk
+    std::vector<glm::ivec3> chunk_poses;
+    std::unordered_set<long long> chunk_keys;
+    long long old_size = 0;
+    std::error_code ec;
+    std::string mfn = ToMapFileName(mid);
+    if (std::filesystem::exists(mfn, ec)) {
+        old_size += std::filesystem::file_size(mfn, ec);
+        for (int y = 0; kMapHeight / kChunkSize > y; y++) {
+            for (int x = 0; kMapWidth / kChunkSize > x; x++) {
+                for (int z = 0; kMapDepth / kChunkSize > z; z++) {
+                    chunk_poses.push_back(glm::ivec3(x, y, z));
+                    chunk_keys.insert(ToChunkKey(chunk_poses.back()));
+                }
+            }
+        }
+    }
+    for (const auto &entry :
+        std::filesystem::directory_iterator(ToChunkDirName(mid), ec)) {
+        if (entry.path().extension() != ".chunk") {
+            continue;
+        }
+        glm::ivec3 chunk_pos;
+        char sep_xy, sep_yz;
+        std::stringstream ss(entry.path().stem().string());
+        if (!(ss >> chunk_pos.x >> sep_xy >> chunk_pos.y >> sep_yz >> chunk_pos.z)) {
+            continue;
+        }
+        old_size += entry.file_size(ec);
+        if (chunk_keys.insert(ToChunkKey(chunk_pos)).second) {
+            chunk_poses.push_back(chunk_pos);
+        }
+    }
+
+    long long new_size = 0;
+    for (const glm::ivec3 &chunk_pos : chunk_poses) {
+        Chunk chunk;
+        if (!ReadChunkFile(chunk_pos, chunk) && !ReadLegacyChunk(chunk_pos, chunk)) {
+            std::cerr << "Error: Failed to convert chunk: "
+                << ToChunkFileName(mid, chunk_pos) << std::endl;
+            Quit();
+        }
+        WriteChunkFile(chunk_pos, chunk);
+        new_size += std::filesystem::file_size(ToChunkFileName(mid, chunk_pos), ec);
+    }
+    std::cout << "Map: " << ToChunkDirName(mid) << ", Chunks: " << chunk_poses.size()
+        << ", Encoding: " << encoding << ", Size: " << old_size << " -> "
+        << new_size << " bytes" << std::endl;
+}
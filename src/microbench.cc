@@ -0,0 +1,527 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/rotate_vector.hpp>
+
+#include "game.h"
+
+// 使い方:
+//   microbench [reps] [width height]
+// CastRay, CalcPixelColor, 当たり判定, tick, 爆発, 光の更新, Chunkの符号化と
+// Mapの読み書きを個別に計測し、
+// 結果をJSONで標準出力に書く
+// Mapは乱数の種を固定して生成するので、同じコードなら毎回同じRayとBlockを処理する
+// checksumは処理結果から求めた値で、速さを比べる前に結果が変わっていないかを確かめる
+
+class MicroBench {
+public:
+    MicroBench(int width, int height, int n_reps);
+    void Run();
+
+private:
+    // 生成するMapの大きさ(Chunk単位)と、保存先のMap ID
+    static constexpr const int kMapChunksX = 4;
+    static constexpr const int kMapChunksY = 3;
+    static constexpr const int kMapChunksZ = 4;
+    static constexpr const int kBenchMapId = 0xbe7c0000;
+    static constexpr const unsigned kSeed = 20240501;
+
+    static constexpr const int kNRandomCameras = 64;
+    static constexpr const int kNRandomRaysPerCamera = 4096;
+    static constexpr const int kNScriptedFrames = 8;
+    static constexpr const int kNCollisionTests = 200000;
+    static constexpr const int kNMoveSteps = 100000;
+    static constexpr const int kNScheduledTicks = 100000;
+    static constexpr const int kMaxTickDelay = 64;
+    static constexpr const int kNExplosions = 256;
+    static constexpr const int kNLightEdits = 4096;
+
+    struct Camera {
+        glm::vec3 pos, dir, plane_x, plane_y;
+    };
+    struct Result {
+        // n_ops: 1回の計測で処理した数, checksum: 処理結果から求めた値
+        long long n_ops;
+        unsigned long long checksum;
+    };
+
+    Game game_;
+    int n_reps_;
+    std::mt19937 rng_;
+    bool first_result_ = true;
+
+    std::vector<Camera> random_cameras_;
+    std::vector<glm::vec2> random_pixels_;
+    // kNScriptedFrames個のカメラから全pixelに飛ばしたRayのうち、衝突したもの
+    std::vector<Game::Ray> recorded_hits_;
+    // 生成したChunkを符号化したもの([ChunkEncoding][Chunk])
+    std::vector<std::vector<char>> encoded_chunks_[2];
+
+    // [0, 1)の乱数(実装によらず同じ列になるように、分布クラスは使わない)
+    float Random() { return rng_() / 4294967296.0f; }
+    static int TerrainHeight(int x, int z);
+    void GenerateMap();
+    void MakeRandomRays();
+    void SetCamera(const Camera &camera);
+    void SetScriptedCamera(int frame);
+
+    // benchをn_reps_回繰り返し、最も速かった回と中央値を出力する
+    void Measure(const std::string &name, const std::function<Result()> &bench);
+
+    Result CastRandomRays();
+    Result CastScriptedRays();
+    Result CastScriptedPackets();
+    Result CalcRecordedColors();
+    Result SweepBoxes();
+    Result MovePlayer();
+    Result TickBlocks();
+    Result TraceExplosions();
+    Result UpdateLight();
+    Result EncodeChunks(Game::ChunkEncoding encoding);
+    Result DecodeChunks(Game::ChunkEncoding encoding);
+    Result SaveMap();
+    Result LoadMap();
+};
+
+MicroBench::MicroBench(int width, int height, int n_reps)
+    : game_(width, height, false, true), n_reps_(n_reps), rng_(kSeed) { }
+
+void MicroBench::Run() {
+    std::error_code ec;
+    std::filesystem::remove_all(game_.ToChunkDirName(kBenchMapId), ec);
+    game_.Init(kBenchMapId);
+    GenerateMap();
+    MakeRandomRays();
+
+    std::cout << "{\n"
+        << "  \"version\": 1,\n"
+        << "  \"config\": {\"width\": " << game_.screen_width_
+        << ", \"height\": " << game_.screen_height_ << ", \"reps\": " << n_reps_
+        << ", \"seed\": " << kSeed << "},\n"
+        << "  \"benchmarks\": [\n";
+    Measure("cast_ray_random", [this] { return CastRandomRays(); });
+    Measure("cast_ray_scripted", [this] { return CastScriptedRays(); });
+    Measure("cast_ray_packet_scripted", [this] { return CastScriptedPackets(); });
+    Measure("calc_pixel_color", [this] { return CalcRecordedColors(); });
+    Measure("sweep_box", [this] { return SweepBoxes(); });
+    Measure("step_physics", [this] { return MovePlayer(); });
+    Measure("tick_blocks", [this] { return TickBlocks(); });
+    Measure("trace_explosions", [this] { return TraceExplosions(); });
+    Measure("update_light", [this] { return UpdateLight(); });
+    Measure("encode_chunk_raw", [this] { return EncodeChunks(Game::kChunkEncodingRaw); });
+    Measure("encode_chunk_rle", [this] { return EncodeChunks(Game::kChunkEncodingRle); });
+    Measure("decode_chunk_raw", [this] { return DecodeChunks(Game::kChunkEncodingRaw); });
+    Measure("decode_chunk_rle", [this] { return DecodeChunks(Game::kChunkEncodingRle); });
+    Measure("save_map", [this] { return SaveMap(); });
+    Measure("load_map", [this] { return LoadMap(); });
+    std::cout << "\n  ]\n}\n";
+
+    game_.StopChunkIo();
+    std::filesystem::remove_all(game_.ToChunkDirName(kBenchMapId), ec);
+}
+
+int MicroBench::TerrainHeight(int x, int z) {
+    return 18 + (int)(5.0 * std::sin(x * 0.21) + 4.0 * std::cos(z * 0.17)
+        + 2.0 * std::sin((x + z) * 0.4));
+}
+
+void MicroBench::GenerateMap() {
+    // 読み込みを依頼した(全てAirの)Chunkを受け取ってから置き換える
+    game_.WaitChunkIo();
+    game_.UpdateChunks();
+
+    const int width = kMapChunksX * Game::kChunkSize;
+    const int depth = kMapChunksZ * Game::kChunkSize;
+    const int height = kMapChunksY * Game::kChunkSize;
+    std::vector<char> blocks(width * height * depth, Game::kAirBlock);
+    auto block_at = [&](int x, int y, int z) -> char & {
+        return blocks[(y * width + x) * depth + z];
+    };
+    for (int x = 0; width > x; x++) {
+        for (int z = 0; depth > z; z++) {
+            int h = TerrainHeight(x, z);
+            for (int y = 0; h > y; y++) {
+                block_at(x, y, z) = y == h - 1 ? 1 : 11;  // Grass, Stone
+            }
+        }
+    }
+    // 地形の上に柱と、葉の塊を置く
+    for (int i = 0; 60 > i; i++) {
+        int x = 2 + (int)(Random() * (width - 4));
+        int z = 2 + (int)(Random() * (depth - 4));
+        int h = TerrainHeight(x, z);
+        int top = std::min(height - 3, h + 2 + (int)(Random() * 8));
+        char block = Random() < 0.5 ? 4 : 5;  // Brick, Cherry log
+        for (int y = h; top > y; y++) {
+            block_at(x, y, z) = block;
+        }
+        for (int dx = -1; 1 >= dx; dx++) {
+            for (int dz = -1; 1 >= dz; dz++) {
+                block_at(x + dx, top, z + dz) = 7;  // Cherry leaves
+            }
+        }
+    }
+
+    for (int cy = 0; kMapChunksY > cy; cy++) {
+        for (int cx = 0; kMapChunksX > cx; cx++) {
+            for (int cz = 0; kMapChunksZ > cz; cz++) {
+                std::unique_ptr<Game::Chunk> chunk(new Game::Chunk);
+                for (int y = 0; Game::kChunkSize > y; y++) {
+                    for (int x = 0; Game::kChunkSize > x; x++) {
+                        for (int z = 0; Game::kChunkSize > z; z++) {
+                            chunk->blocks[Game::ToChunkIndex(x, y, z)] = block_at(
+                                cx * Game::kChunkSize + x, cy * Game::kChunkSize + y,
+                                cz * Game::kChunkSize + z);
+                        }
+                    }
+                }
+                game_.BuildBrickMap(*chunk);
+                game_.BuildLod(*chunk);
+                chunk->dirty = true;
+                for (Game::ChunkEncoding encoding :
+                    { Game::kChunkEncodingRaw, Game::kChunkEncodingRle }) {
+                    encoded_chunks_[encoding].emplace_back();
+                    Game::EncodeChunk(*chunk, encoding, encoded_chunks_[encoding].back());
+                }
+                game_.InsertChunk(glm::ivec3(cx, cy, cz), std::move(chunk));
+            }
+        }
+    }
+}
+
+void MicroBench::SetCamera(const Camera &camera) {
+    game_.pos_ = camera.pos;
+    game_.dir_ = camera.dir;
+    game_.plane_x_ = camera.plane_x;
+    game_.plane_y_ = camera.plane_y;
+}
+
+void MicroBench::SetScriptedCamera(int frame) {
+    game_.SetBenchCamera(frame, kNScriptedFrames);
+}
+
+void MicroBench::MakeRandomRays() {
+    const int width = kMapChunksX * Game::kChunkSize;
+    const int depth = kMapChunksZ * Game::kChunkSize;
+    for (int i = 0; kNRandomCameras > i; i++) {
+        game_.InitPlayer();
+        float x = 4.0 + Random() * (width - 8);
+        float z = 4.0 + Random() * (depth - 8);
+        game_.pos_ = glm::vec3(x, 30.0 + Random() * 10.0, z);
+        float yaw = 2.0 * M_PI * Random();
+        game_.dir_ = glm::rotateY(game_.dir_, yaw);
+        game_.plane_x_ = glm::rotateY(game_.plane_x_, yaw);
+        game_.plane_y_ = glm::rotateY(game_.plane_y_, yaw);
+        game_.TryRotateY(Random() * 1.0 - 0.3);
+        random_cameras_.push_back({ game_.pos_, game_.dir_, game_.plane_x_, game_.plane_y_ });
+        for (int j = 0; kNRandomRaysPerCamera > j; j++) {
+            random_pixels_.emplace_back(Random() * (game_.screen_width_ - 1),
+                Random() * (game_.screen_height_ - 1));
+        }
+    }
+
+    // CalcPixelColorに渡す、衝突したRayを記録しておく
+    for (int frame = 0; kNScriptedFrames > frame; frame++) {
+        SetScriptedCamera(frame);
+        for (int y = 0; game_.screen_height_ > y; y++) {
+            for (int x = 0; game_.screen_width_ > x; x++) {
+                Game::Ray ray;
+                if (game_.CastRay(x, y, ray)) {
+                    recorded_hits_.push_back(ray);
+                }
+            }
+        }
+    }
+}
+
+void MicroBench::Measure(const std::string &name, const std::function<Result()> &bench) {
+    std::vector<double> times;
+    Result result = {};
+    for (int i = 0; n_reps_ > i; i++) {
+        auto start = std::chrono::steady_clock::now();
+        result = bench();
+        auto end = std::chrono::steady_clock::now();
+        times.push_back(std::chrono::duration<double>(end - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    double min_ns = times.front() * 1e9 / std::max(1LL, result.n_ops);
+    double median_ns = times[times.size() / 2] * 1e9 / std::max(1LL, result.n_ops);
+
+    if (!first_result_) {
+        std::cout << ",\n";
+    }
+    first_result_ = false;
+    std::cout << "    {\"name\": \"" << name << "\", \"n\": " << result.n_ops
+        << ", \"ns_per_op\": " << min_ns << ", \"ns_per_op_median\": " << median_ns
+        << ", \"ops_per_s\": " << (min_ns > 0.0 ? 1e9 / min_ns : 0.0)
+        << ", \"checksum\": " << result.checksum << "}" << std::flush;
+}
+
+MicroBench::Result MicroBench::CastRandomRays() {
+    Result result = {};
+    for (int i = 0; kNRandomCameras > i; i++) {
+        SetCamera(random_cameras_[i]);
+        for (int j = 0; kNRandomRaysPerCamera > j; j++) {
+            const glm::vec2 &pixel = random_pixels_[i * kNRandomRaysPerCamera + j];
+            Game::Ray ray;
+            bool hit = game_.CastRay(pixel.x, pixel.y, ray);
+            result.checksum += hit ? ray.n_steps + 1 : 0;
+            result.n_ops++;
+        }
+    }
+    return result;
+}
+
+MicroBench::Result MicroBench::CastScriptedRays() {
+    Result result = {};
+    for (int frame = 0; kNScriptedFrames > frame; frame++) {
+        SetScriptedCamera(frame);
+        for (int y = 0; game_.screen_height_ > y; y++) {
+            for (int x = 0; game_.screen_width_ > x; x++) {
+                Game::Ray ray;
+                bool hit = game_.CastRay(x, y, ray);
+                result.checksum += hit ? ray.n_steps + 1 : 0;
+                result.n_ops++;
+            }
+        }
+    }
+    return result;
+}
+
+MicroBench::Result MicroBench::CastScriptedPackets() {
+    // CastRayPacketは2x2 pixelずつ進めるので、n_opsはRayの数で数える
+    Result result = {};
+    for (int frame = 0; kNScriptedFrames > frame; frame++) {
+        SetScriptedCamera(frame);
+        for (int y = 0; game_.screen_height_ - 1 > y; y += 2) {
+            for (int x = 0; game_.screen_width_ - 1 > x; x += 2) {
+                Game::Ray rays[4];
+                int hits = game_.CastRayPacket(x, y, rays);
+                for (int i = 0; 4 > i; i++) {
+                    result.checksum += hits >> i & 1 ? rays[i].n_steps + 1 : 0;
+                }
+                result.n_ops += 4;
+            }
+        }
+    }
+    return result;
+}
+
+MicroBench::Result MicroBench::CalcRecordedColors() {
+    Result result = {};
+    for (const Game::Ray &ray : recorded_hits_) {
+        result.checksum += game_.CalcPixelColor(ray);
+        result.n_ops++;
+    }
+    return result;
+}
+
+MicroBench::Result MicroBench::SweepBoxes() {
+    // 毎回同じ位置を調べるように、乱数の種を固定する
+    std::mt19937 rng(kSeed);
+    const float width = kMapChunksX * Game::kChunkSize;
+    const float depth = kMapChunksZ * Game::kChunkSize;
+    Result result = {};
+    for (int i = 0; kNCollisionTests > i; i++) {
+        glm::vec3 pos(rng() / 4294967296.0f * width,
+            10.0 + rng() / 4294967296.0f * 25.0, rng() / 4294967296.0f * depth);
+        int axis = rng() % 3;
+        // 1 stepで動く距離(最大で落ちる速さ)程度
+        float move = (rng() / 4294967296.0f - 0.5f) * 2.0f;
+        glm::vec3 box_min, box_max;
+        Game::GetPlayerBox(pos, box_min, box_max);
+        bool hit = game_.SweepBox(box_min, box_max, axis, move);
+        uint32_t bits;
+        std::memcpy(&bits, &move, sizeof(bits));
+        result.checksum += hit ? bits : 1;
+        result.n_ops++;
+    }
+    return result;
+}
+
+MicroBench::Result MicroBench::MovePlayer() {
+    // 地形の上を乱数で決めた向きに歩き回り、ときどきジャンプする(壁や柱に当たると止まる)
+    std::mt19937 rng(kSeed);
+    game_.InitPlayer();
+    game_.player_pos_.y = TerrainHeight((int)game_.pos_.x, (int)game_.pos_.z)
+        + Game::kPlayerLowerHalfHeight + 0.5;
+    Result result = {};
+    for (int i = 0; kNMoveSteps > i; i++) {
+        if (i % 64 == 0) {
+            float angle = rng() / 4294967296.0f * 2.0 * M_PI;
+            game_.move_input_ = glm::vec3(std::cos(angle), 0.0, std::sin(angle));
+            game_.jump_input_ = rng() % 2 == 0;
+        }
+        game_.StepPhysics(Game::kPhysicsTimeStep);
+        result.n_ops++;
+    }
+    uint32_t bits[3];
+    std::memcpy(bits, &game_.player_pos_, sizeof(bits));
+    result.checksum = (unsigned long long)bits[0] << 32 ^ (unsigned long long)bits[1] << 16
+        ^ bits[2];
+    return result;
+}
+
+MicroBench::Result MicroBench::TickBlocks() {
+    // Mapのあちこちにtickを予約し(TNT以外は何もしない)、全て処理するまで進める
+    // その間のRandom tickで消えた葉は、最後に戻す
+    std::mt19937 rng(kSeed);
+    game_.tick_rng_.seed(kSeed);
+    std::vector<glm::ivec3> leaves;
+    for (long long key : game_.random_tick_chunks_) {
+        glm::ivec3 origin = Game::FromChunkKey(key) * Game::kChunkSize;
+        for (int index : game_.chunks_.at(key)->random_tick_blocks) {
+            leaves.push_back(origin + glm::ivec3(index >> Game::kChunkShift & Game::kChunkMask,
+                index >> (2 * Game::kChunkShift), index & Game::kChunkMask));
+        }
+    }
+    for (int i = 0; kNScheduledTicks > i; i++) {
+        glm::ivec3 pos(rng() % (kMapChunksX * Game::kChunkSize),
+            rng() % (kMapChunksY * Game::kChunkSize), rng() % (kMapChunksZ * Game::kChunkSize));
+        game_.ScheduleBlockTick(pos, 1 + rng() % kMaxTickDelay);
+    }
+    Result result = {};
+    while (!game_.scheduled_ticks_.empty()) {
+        result.n_ops += game_.TickBlocks();
+    }
+    for (const glm::ivec3 &pos : leaves) {
+        result.checksum += game_.GetMapBlock(pos) == Game::kAirBlock;
+        game_.SetMapBlock(pos, Game::kCherryLeavesBlock);
+    }
+    result.checksum = result.checksum << 32 ^ result.n_ops;
+    return result;
+}
+
+MicroBench::Result MicroBench::TraceExplosions() {
+    // 地表で爆発させたときに壊れるBlockを求める(Mapは書き換えない)
+    // 16個ずつ、ゲーム中の1 tickと同じようにまとめて飛ばす
+    std::mt19937 rng(kSeed);
+    std::vector<Game::Explosion> explosions;
+    Result result = {};
+    for (int i = 0; kNExplosions > i; i++) {
+        int x = rng() % (kMapChunksX * Game::kChunkSize);
+        int z = rng() % (kMapChunksZ * Game::kChunkSize);
+        explosions.push_back({ glm::ivec3(x, TerrainHeight(x, z), z), (uint32_t)rng() });
+        if ((int)explosions.size() == Game::kMaxExplosionsPerTick) {
+            game_.TraceExplosions(explosions);
+            result.checksum += game_.blast_blocks_.size();
+            result.n_ops += explosions.size() * Game::kNBlastRays;
+            explosions.clear();
+        }
+    }
+    return result;
+}
+
+MicroBench::Result MicroBench::UpdateLight() {
+    // 地表の少し上に石を置いて影を作り、すぐ壊して光を戻す(Mapは元に戻る)
+    std::mt19937 rng(kSeed);
+    Result result = {};
+    for (int i = 0; kNLightEdits > i; i++) {
+        int x = rng() % (kMapChunksX * Game::kChunkSize);
+        int z = rng() % (kMapChunksZ * Game::kChunkSize);
+        glm::ivec3 pos(x, TerrainHeight(x, z) + 1 + rng() % 4, z);
+        if (game_.GetMapBlock(pos) != Game::kAirBlock) {
+            continue;
+        }
+        game_.SetMapBlock(pos, 11);  // Stone
+        result.checksum += game_.GetMapLight(pos - glm::ivec3(0, 1, 0));
+        game_.SetMapBlock(pos, Game::kAirBlock);
+        result.checksum += game_.GetMapLight(pos - glm::ivec3(0, 1, 0));
+        result.n_ops += 2;
+    }
+    return result;
+}
+
+MicroBench::Result MicroBench::EncodeChunks(Game::ChunkEncoding encoding) {
+    // Chunkの数が少ないので、同じChunkを何度も符号化する
+    const int n_rounds = 16;
+    Result result = {};
+    std::vector<char> data;
+    for (int round = 0; n_rounds > round; round++) {
+        for (const auto &entry : game_.chunks_) {
+            if (entry.second) {
+                Game::EncodeChunk(*entry.second, encoding, data);
+                result.checksum += data.size();
+                result.n_ops++;
+            }
+        }
+    }
+    return result;
+}
+
+MicroBench::Result MicroBench::DecodeChunks(Game::ChunkEncoding encoding) {
+    // Chunkの数が少ないので、同じ列を何度も復号する
+    const int n_rounds = 16;
+    Result result = {};
+    std::unique_ptr<Game::Chunk> chunk(new Game::Chunk);
+    for (int round = 0; n_rounds > round; round++) {
+        for (const std::vector<char> &data : encoded_chunks_[encoding]) {
+            if (!Game::DecodeChunk(encoding, data, *chunk)) {
+                std::cerr << "Error: Failed to decode chunk." << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            result.checksum += chunk->blocks[Game::kChunkVolume / 2];
+            result.n_ops++;
+        }
+    }
+    return result;
+}
+
+MicroBench::Result MicroBench::SaveMap() {
+    // 全てのChunkを変更したことにして書き出す
+    Result result = {};
+    for (auto &entry : game_.chunks_) {
+        if (entry.second) {
+            entry.second->dirty = true;
+            result.n_ops++;
+        }
+    }
+    game_.SaveMap(kBenchMapId);
+    std::error_code ec;
+    for (const auto &file :
+        std::filesystem::directory_iterator(game_.ToChunkDirName(kBenchMapId), ec)) {
+        result.checksum += file.file_size(ec);
+    }
+    return result;
+}
+
+MicroBench::Result MicroBench::LoadMap() {
+    // PlayerのいるChunkの周り全てを、空のChunkも含めて読み込む
+    game_.InitPlayer();
+    game_.LoadMap(kBenchMapId);
+    game_.UpdateChunks(true);
+    game_.WaitChunkIo();
+    game_.UpdateChunks();
+    Result result = {};
+    for (const auto &entry : game_.chunks_) {
+        result.n_ops++;
+        if (entry.second) {
+            result.checksum += entry.second->n_solid_blocks;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    int n_reps = argc >= 2 ? std::atoi(argv[1]) : 5;
+    int width = argc >= 4 ? std::atoi(argv[2]) : 320;
+    int height = argc >= 4 ? std::atoi(argv[3]) : 180;
+    if (n_reps <= 0 || width <= 0 || height <= 0) {
+        std::cerr << "Error: Usage: microbench [reps] [width height]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    MicroBench bench(width, height, n_reps);
+    bench.Run();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,187 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+const char *const Profiler::kSectionNames[kNSections] = {
+    "frame", "input", "physics", "tick", "chunks", "wait_render",
+    "raycast", "upscale", "cursor", "blit", "hud", "present",
+};
+
+const char *const Profiler::kCounterNames[kNCounters] = {
+    "rays", "ray_steps", "ray_hits", "cache_lookups", "cache_misses",
+    "block_ticks", "explosions",
+};
+
+Profiler::Profiler() : last_end_(Clock::now()), frames_(kNFrames) {
+    for (std::atomic<long long> &ns : section_ns_) {
+        ns.store(0);
+    }
+    for (std::atomic<long long> &count : counts_) {
+        count.store(0);
+    }
+}
+
+Profiler::~Profiler() {
+    Export();
+}
+
+void Profiler::EndFrame() {
+    Clock::time_point now = Clock::now();
+    Add(kFrame, now - last_end_);
+    last_end_ = now;
+
+    Frame &frame = frames_[n_frames_ % kNFrames];
+    for (int i = 0; kNSections > i; i++) {
+        frame.ms[i] = section_ns_[i].exchange(0, std::memory_order_relaxed) / 1e6;
+    }
+    for (int i = 0; kNCounters > i; i++) {
+        frame.counts[i] = counts_[i].exchange(0, std::memory_order_relaxed);
+    }
+    n_frames_++;
+    if (!export_path_.empty() && n_frames_ - n_exported_frames_ >= kExportInterval) {
+        Export();
+    }
+}
+
+Profiler::Stats Profiler::CalcStats(Section section) const {
+    int n = std::min<long long>(n_frames_, kNFrames);
+    if (n == 0) {
+        return {};
+    }
+    std::vector<float> values(n);
+    double sum = 0.0;
+    for (int i = 0; n > i; i++) {
+        values[i] = frames_[i].ms[section];
+        sum += values[i];
+    }
+    std::sort(values.begin(), values.end());
+    // 最近順位法(値の小さい方からq * n番目)
+    auto percentile = [&](double q) {
+        int rank = std::max(1, (int)std::ceil(q * n));
+        return (double)values[rank - 1];
+    };
+    return { sum / n, percentile(0.5), percentile(0.95), percentile(0.99), values.back() };
+}
+
+double Profiler::CalcCounterMean(Counter counter) const {
+    int n = std::min<long long>(n_frames_, kNFrames);
+    if (n == 0) {
+        return 0.0;
+    }
+    double sum = 0.0;
+    for (int i = 0; n > i; i++) {
+        sum += frames_[i].counts[counter];
+    }
+    return sum / n;
+}
+
+void Profiler::FormatSummary(std::vector<std::string> &lines) const {
+    lines.clear();
+    std::ostringstream line;
+    line << "last " << std::min<long long>(n_frames_, kNFrames) << " frames";
+    lines.push_back(line.str());
+    line.str("");
+    line << std::left << std::setw(12) << "ms" << std::right << std::setw(6) << "mean"
+        << std::setw(6) << "p50" << std::setw(6) << "p99";
+    lines.push_back(line.str());
+    for (int i = 0; kNSections > i; i++) {
+        Stats stats = CalcStats((Section)i);
+        line.str("");
+        line << std::left << std::setw(12) << kSectionNames[i] << std::right
+            << std::fixed << std::setprecision(2)
+            << std::setw(6) << stats.mean << std::setw(6) << stats.p50
+            << std::setw(6) << stats.p99;
+        lines.push_back(line.str());
+    }
+
+    double n_rays = CalcCounterMean(kRays);
+    line.str("");
+    line << std::fixed << std::setprecision(0) << "rays " << n_rays
+        << std::setprecision(1) << "  steps/ray "
+        << (n_rays > 0.0 ? CalcCounterMean(kRaySteps) / n_rays : 0.0)
+        << "  hit " << (n_rays > 0.0 ? CalcCounterMean(kRayHits) / n_rays * 100.0 : 0.0)
+        << "%";
+    lines.push_back(line.str());
+    double n_lookups = CalcCounterMean(kCacheLookups);
+    if (n_lookups > 0.0) {
+        line.str("");
+        line << std::fixed << std::setprecision(1) << "cache miss "
+            << CalcCounterMean(kCacheMisses) / n_lookups * 100.0 << "%";
+        lines.push_back(line.str());
+    }
+}
+
+bool Profiler::OpenExport(const std::string &path) {
+    export_path_ = path;
+    export_json_ = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+    n_exported_frames_ = n_frames_;
+    if (export_json_) {
+        return std::ofstream(path).good();
+    }
+    csv_.open(path);
+    if (!csv_) {
+        return false;
+    }
+    csv_ << "frame";
+    for (const char *name : kSectionNames) {
+        csv_ << "," << name << "_ms";
+    }
+    for (const char *name : kCounterNames) {
+        csv_ << "," << name;
+    }
+    csv_ << "\n";
+    csv_.flush();
+    return true;
+}
+
+void Profiler::Export() {
+    if (export_path_.empty() || n_exported_frames_ == n_frames_) {
+        return;
+    }
+    if (export_json_) {
+        ExportJson();
+    }
+    else {
+        ExportCsv();
+    }
+    n_exported_frames_ = n_frames_;
+}
+
+void Profiler::ExportCsv() {
+    // 書き出す前にリングバッファから押し出されたフレームは書けない
+    long long begin = std::max(n_exported_frames_, n_frames_ - kNFrames);
+    for (long long i = begin; n_frames_ > i; i++) {
+        const Frame &frame = frames_[i % kNFrames];
+        csv_ << i;
+        for (float ms : frame.ms) {
+            csv_ << "," << ms;
+        }
+        for (long long count : frame.counts) {
+            csv_ << "," << count;
+        }
+        csv_ << "\n";
+    }
+    csv_.flush();
+}
+
+void Profiler::ExportJson() {
+    std::ofstream ofs(export_path_);
+    ofs << "{\n  \"frames\": " << n_frames_ << ",\n  \"window\": "
+        << std::min<long long>(n_frames_, kNFrames) << ",\n  \"sections_ms\": {\n";
+    for (int i = 0; kNSections > i; i++) {
+        Stats stats = CalcStats((Section)i);
+        ofs << "    \"" << kSectionNames[i] << "\": {\"mean\": " << stats.mean
+            << ", \"p50\": " << stats.p50 << ", \"p95\": " << stats.p95
+            << ", \"p99\": " << stats.p99 << ", \"max\": " << stats.max << "}"
+            << (i + 1 < kNSections ? ",\n" : "\n");
+    }
+    ofs << "  },\n  \"counters_per_frame\": {\n";
+    for (int i = 0; kNCounters > i; i++) {
+        ofs << "    \"" << kCounterNames[i] << "\": " << CalcCounterMean((Counter)i)
+            << (i + 1 < kNCounters ? ",\n" : "\n");
+    }
+    ofs << "  }\n}\n";
+}
@@ -41,7 +41,10 @@ QuickCG can handle some things that standard C++ doesn't but that are commonly u
 #include "quickcg.h"
 
 #include <SDL/SDL.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
 #include <cstdlib>
+#include <cstring>
 #include <cmath>
 #include <vector>
 #include <map>
@@ -59,7 +62,7 @@ int w; //width of the screen
 int h; //height of the screen
 
 std::map<int, bool> keypressed; //for the "keyPressed" function to detect a keypress only once
-SDL_Surface* scr; //the single SDL surface used
+SDL_Surface* scr; //the single SDL surface used (with screenGL, a surface in system memory that redraw uploads)
 Uint8* inkeys = 0;
 SDL_Event event = {0};
 
@@ -133,6 +136,143 @@ void screen(int width, int height, bool fullscreen, const std::string& text)
   SDL_EnableUNICODE(1); //for the text input things
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//OPENGL PRESENTATION///////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+//With screenGL, everything is still drawn into scr by the CPU, and redraw uploads scr
+//into a texture that is stretched over the whole window by the GPU.
+//If the driver has GL_ARB_buffer_storage, scr's pixels live in a pixel buffer object
+//that stays mapped, so the upload needs no copy on our side.
+bool gl = false;
+GLuint glTexture = 0;
+GLuint glPbo = 0; //0 if scr is in ordinary memory and glTexSubImage2D copies from it
+GLsync glUploadFence = 0;
+PFNGLBINDBUFFERPROC glBindBufferFn;
+PFNGLCLIENTWAITSYNCPROC glClientWaitSyncFn;
+PFNGLDELETESYNCPROC glDeleteSyncFn;
+PFNGLFENCESYNCPROC glFenceSyncFn;
+
+bool hasGLExtension(const char* name)
+{
+  const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+  if(!extensions) return false;
+  size_t n = std::strlen(name);
+  for(const char* p = std::strstr(extensions, name); p; p = std::strstr(p + n, name))
+  {
+    if((p == extensions || p[-1] == ' ') && (p[n] == ' ' || p[n] == 0)) return true;
+  }
+  return false;
+}
+
+//Tries to put scr's pixels in a persistently mapped pixel buffer object
+bool initGLPersistentBuffer()
+{
+  if(!hasGLExtension("GL_ARB_buffer_storage") || !hasGLExtension("GL_ARB_sync")) return false;
+  PFNGLGENBUFFERSPROC glGenBuffersFn = (PFNGLGENBUFFERSPROC)SDL_GL_GetProcAddress("glGenBuffers");
+  PFNGLBUFFERSTORAGEPROC glBufferStorageFn = (PFNGLBUFFERSTORAGEPROC)SDL_GL_GetProcAddress("glBufferStorage");
+  PFNGLMAPBUFFERRANGEPROC glMapBufferRangeFn = (PFNGLMAPBUFFERRANGEPROC)SDL_GL_GetProcAddress("glMapBufferRange");
+  glBindBufferFn = (PFNGLBINDBUFFERPROC)SDL_GL_GetProcAddress("glBindBuffer");
+  glFenceSyncFn = (PFNGLFENCESYNCPROC)SDL_GL_GetProcAddress("glFenceSync");
+  glClientWaitSyncFn = (PFNGLCLIENTWAITSYNCPROC)SDL_GL_GetProcAddress("glClientWaitSync");
+  glDeleteSyncFn = (PFNGLDELETESYNCPROC)SDL_GL_GetProcAddress("glDeleteSync");
+  if(!glGenBuffersFn || !glBufferStorageFn || !glMapBufferRangeFn || !glBindBufferFn
+  || !glFenceSyncFn || !glClientWaitSyncFn || !glDeleteSyncFn) return false;
+
+  GLsizeiptr size = (GLsizeiptr)w * h * 4;
+  GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  glGenBuffersFn(1, &glPbo);
+  glBindBufferFn(GL_PIXEL_UNPACK_BUFFER, glPbo);
+  glBufferStorageFn(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+  void* pixels = glMapBufferRangeFn(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+  if(pixels) scr = SDL_CreateRGBSurfaceFrom(pixels, w, h, 32, w * 4, 0xFF0000, 0xFF00, 0xFF, 0);
+  if(!pixels || !scr)
+  {
+    glBindBufferFn(GL_PIXEL_UNPACK_BUFFER, 0);
+    glPbo = 0; //the buffer is left to be freed with the context
+    return false;
+  }
+  return true;
+}
+
+//Like screen, but presents through OpenGL: the screen is width*height pixels (what the
+//drawing functions and drawBuffer see) and is scaled to a window of windowWidth*windowHeight.
+//Returns false without creating a window if OpenGL is not available.
+bool screenGL(int width, int height, int windowWidth, int windowHeight, bool fullscreen, const std::string& text)
+{
+  w = width;
+  h = height;
+
+  if(SDL_Init(SDL_INIT_EVERYTHING) < 0)
+  {
+    printf("Unable to init SDL: %s\n", SDL_GetError());
+    SDL_Quit();
+    std::exit(1);
+  }
+  std::atexit(SDL_Quit);
+  SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+  SDL_GL_SetAttribute(SDL_GL_SWAP_CONTROL, 0); //don't wait for vsync, the caller paces its frames
+  if(!SDL_SetVideoMode(windowWidth, windowHeight, 32, SDL_OPENGL | (fullscreen ? SDL_FULLSCREEN : 0))) return false;
+  SDL_WM_SetCaption(text.c_str(), NULL);
+  SDL_EnableUNICODE(1); //for the text input things
+
+  if(!initGLPersistentBuffer())
+  {
+    scr = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 32, 0xFF0000, 0xFF00, 0xFF, 0);
+    if(scr == NULL)
+    {
+      printf("Unable to create surface: %s\n", SDL_GetError());
+      SDL_Quit();
+      std::exit(1);
+    }
+  }
+
+  glGenTextures(1, &glTexture);
+  glBindTexture(GL_TEXTURE_2D, glTexture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  //0xRRGGBB pixels are B, G, R, X in memory
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, w, h, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+  glEnable(GL_TEXTURE_2D);
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_BLEND);
+  glViewport(0, 0, windowWidth, windowHeight);
+  gl = true;
+  return true;
+}
+
+//Uploads the given rectangle of scr to the texture and draws the texture over the whole window
+void redrawGL(int x, int y, int width, int height)
+{
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, x);
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, y);
+  //with a bound pixel buffer object, the last argument is an offset into it
+  const void* pixels = glPbo ? NULL : scr->pixels;
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, pixels);
+  if(glPbo) glUploadFence = glFenceSyncFn(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+  //row 0 of the screen is the top of the window
+  glBegin(GL_QUADS);
+  glTexCoord2f(0, 1); glVertex2f(-1, -1);
+  glTexCoord2f(1, 1); glVertex2f(1, -1);
+  glTexCoord2f(1, 0); glVertex2f(1, 1);
+  glTexCoord2f(0, 0); glVertex2f(-1, 1);
+  glEnd();
+  SDL_GL_SwapBuffers();
+
+  if(glUploadFence)
+  {
+    //the upload must have read the mapped buffer before anyone draws into it again,
+    //and drawing functions may do that any time after redraw returns
+    glClientWaitSyncFn(glUploadFence, GL_SYNC_FLUSH_COMMANDS_BIT, (GLuint64)1000000000);
+    glDeleteSyncFn(glUploadFence);
+    glUploadFence = 0;
+  }
+}
+
 //Locks the screen
 void lock()
 {
@@ -152,10 +292,23 @@ void unlock()
 //drawing the whole screen because it's slow.
 void redraw()
 {
+  if(gl) { redrawGL(0, 0, w, h); return; }
   SDL_UpdateRect(scr, 0, 0, 0, 0);
   //SDL_Flip(scr); // this could potentially be faster than SDL_UpdateRect if double buffering is used
 }
 
+//Updates only a part of the screen, e.g. text drawn over an unchanged image
+void redraw(int x, int y, int width, int height)
+{
+  if(x < 0) { width += x; x = 0; }
+  if(y < 0) { height += y; y = 0; }
+  if(x + width > w) width = w - x;
+  if(y + height > h) height = h - y;
+  if(width <= 0 || height <= 0) return;
+  if(gl) { redrawGL(x, y, width, height); return; }
+  SDL_UpdateRect(scr, x, y, width, height);
+}
+
 //Clears the screen to black
 void cls(const ColorRGB& color)
 {
@@ -187,21 +340,40 @@ ColorRGB pget(int x, int y)
 //Draws a buffer of pixels to the screen
 void drawBuffer(Uint32* buffer)
 {
-  Uint32* bufp;
-  bufp = (Uint32*)scr->pixels;
-
+  if(buffer == scr->pixels) return; //already drawn directly into the screen (see getScreenPixels)
+  Uint8* bufp = (Uint8*)scr->pixels;
   for(int y = 0; y < h; y++)
   {
-    for(int x = 0; x < w; x++)
-    {
-      *bufp = buffer[y * w + x];
-      bufp++;
-    }
-    bufp += scr->pitch / 4;
-    bufp -= w;
+    std::memcpy(bufp, buffer + y * w, w * sizeof(Uint32));
+    bufp += scr->pitch;
   }
 }
 
+//Draws only a rectangle of a buffer of pixels to the screen
+void drawBuffer(Uint32* buffer, int x, int y, int width, int height)
+{
+  if(buffer == scr->pixels) return;
+  if(x < 0) { width += x; x = 0; }
+  if(y < 0) { height += y; y = 0; }
+  if(x + width > w) width = w - x;
+  if(y + height > h) height = h - y;
+  if(width <= 0) return;
+  for(int i = y; i < y + height; i++)
+  {
+    std::memcpy((Uint8*)scr->pixels + i * scr->pitch + x * sizeof(Uint32), buffer + i * w + x, width * sizeof(Uint32));
+  }
+}
+
+//Returns the pixels of the screen if they can be used in place of a buffer given to drawBuffer:
+//32-bit 0xRRGGBB pixels, rows without padding, and a surface that never needs locking
+Uint32* getScreenPixels()
+{
+  if(SDL_MUSTLOCK(scr)) return NULL;
+  if(scr->format->BytesPerPixel != 4 || scr->pitch != w * 4) return NULL;
+  if(scr->format->Rmask != 0xFF0000 || scr->format->Gmask != 0xFF00 || scr->format->Bmask != 0xFF) return NULL;
+  return (Uint32*)scr->pixels;
+}
+
 void getScreenBuffer(std::vector<Uint32>& buffer)
 {
   Uint32* bufp;
@@ -0,0 +1,150 @@
+#include "tile_pool.h"
+
+#include <algorithm>
+#include <chrono>
+
+TilePool::TilePool(int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    n_threads_ = n_threads;
+    workers_.reset(new Worker[n_threads_]);
+    for (int i = 0; n_threads_ > i; i++) {
+        workers_[i].range.store(ToRange(0, 0));
+    }
+    for (int i = 1; n_threads_ > i; i++) {
+        threads_.emplace_back(&TilePool::WorkerLoop, this, i);
+    }
+}
+
+TilePool::~TilePool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    start_cv_.notify_all();
+    for (std::thread &thread : threads_) {
+        thread.join();
+    }
+}
+
+void TilePool::Run(int n_tiles, const std::function<void(int, int)> &render) {
+    // 近いTileは同じスレッドで描画するように、連続したTileを等分して配る
+    for (int i = 0; n_threads_ > i; i++) {
+        Worker &worker = workers_[i];
+        uint32_t begin = (long long)n_tiles * i / n_threads_;
+        uint32_t end = (long long)n_tiles * (i + 1) / n_threads_;
+        worker.range.store(ToRange(begin, end), std::memory_order_relaxed);
+        worker.busy_time = 0.0;
+        worker.max_tile_time = 0.0;
+        worker.n_steals = 0;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        render_ = &render;
+        n_running_ = n_threads_ - 1;
+        generation_++;
+    }
+    start_cv_.notify_all();
+    Work(0);
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this] { return n_running_ == 0; });
+        render_ = nullptr;
+    }
+
+    stats_ = {};
+    double total_time = 0.0;
+    for (int i = 0; n_threads_ > i; i++) {
+        const Worker &worker = workers_[i];
+        total_time += worker.busy_time;
+        stats_.max_tile_ms = std::max(stats_.max_tile_ms, worker.max_tile_time * 1000.0);
+        stats_.max_thread_ms = std::max(stats_.max_thread_ms, worker.busy_time * 1000.0);
+        stats_.n_steals += worker.n_steals;
+    }
+    stats_.mean_tile_ms = n_tiles > 0 ? total_time * 1000.0 / n_tiles : 0.0;
+    stats_.mean_thread_ms = total_time * 1000.0 / n_threads_;
+}
+
+void TilePool::WorkerLoop(int thread) {
+    unsigned generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            start_cv_.wait(lock, [&] { return quit_ || generation_ != generation; });
+            if (quit_) {
+                return;
+            }
+            generation = generation_;
+        }
+        Work(thread);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--n_running_ == 0) {
+                done_cv_.notify_one();
+            }
+        }
+    }
+}
+
+void TilePool::Work(int thread) {
+    Worker &worker = workers_[thread];
+    while (true) {
+        int tile;
+        if (!PopTile(thread, tile)) {
+            // 盗めるTileがなくなったら終わり(盗まれたTileは盗んだスレッドが描画する)
+            if (!StealTiles(thread)) {
+                break;
+            }
+            continue;
+        }
+        auto start = std::chrono::steady_clock::now();
+        (*render_)(tile, thread);
+        auto end = std::chrono::steady_clock::now();
+        double time = std::chrono::duration<double>(end - start).count();
+        worker.busy_time += time;
+        worker.max_tile_time = std::max(worker.max_tile_time, time);
+    }
+}
+
+bool TilePool::PopTile(int thread, int &tile) {
+    std::atomic<uint64_t> &range = workers_[thread].range;
+    uint64_t r = range.load(std::memory_order_acquire);
+    while (true) {
+        uint32_t begin = r >> 32;
+        uint32_t end = r & 0xffffffff;
+        if (begin >= end) {
+            return false;
+        }
+        if (range.compare_exchange_weak(r, ToRange(begin + 1, end),
+            std::memory_order_acq_rel)) {
+            tile = begin;
+            return true;
+        }
+    }
+}
+
+bool TilePool::StealTiles(int thread) {
+    // 隣のスレッドから順に見て、残っているTileの後ろ半分を自分のものにする
+    for (int i = 1; n_threads_ > i; i++) {
+        std::atomic<uint64_t> &range = workers_[(thread + i) % n_threads_].range;
+        uint64_t r = range.load(std::memory_order_acquire);
+        while (true) {
+            uint32_t begin = r >> 32;
+            uint32_t end = r & 0xffffffff;
+            if (begin >= end) {
+                break;
+            }
+            uint32_t n = (end - begin + 1) / 2;
+            if (range.compare_exchange_weak(r, ToRange(begin, end - n),
+                std::memory_order_acq_rel)) {
+                // 自分のrangeは空なので、他のスレッドが書き換えることはない
+                workers_[thread].range.store(ToRange(end - n, end),
+                    std::memory_order_release);
+                workers_[thread].n_steals++;
+                return true;
+            }
+        }
+    }
+    return false;
+}